@@ -40,11 +40,17 @@
 #include <sched.h>
 #include <stdint.h>
 #include <time.h>
+#include <pthread.h>
+#include <poll.h>
+#include <sys/eventfd.h>
 #include <speex/speex_echo.h>
 #include <speex/speex_preprocess.h>
 
 #include "audio-daemon.h"
 #include "mb.h"
+#include "sg.h"
+#include "resample.h"
+#include "dll.h"
 
 int period_size;
 static snd_output_t *output = NULL;
@@ -54,101 +60,224 @@ static char *device = "asym0";
 static int do_playback_work(struct alsa_stream *as);
 static int do_capture_work(struct alsa_stream *as);
 
-int playback_is_running = 0;
-int capture_is_running = 0;
-SpeexEchoState *echo_state;
-SpeexPreprocessState *preprocess_state;
+/* SCHED_FIFO priority of the audio worker, under the IRQ threads. */
+#define ALSA_WORKER_PRIORITY 40
+#define ALSA_MAX_POLLFDS 8
+#define ALSA_CMD_QUEUE 256
+#define ALSA_RESUME_MS 100
+
+/* Capture processing stages, timed separately. */
+enum dsp_stage {
+    DSP_PERIOD = 0,     /* the whole period, for reference */
+    DSP_MIX,            /* guest playback copies and mix */
+    DSP_DOWNMIX,        /* stereo to mono, capture and echo reference */
+    DSP_ECHO,
+    DSP_PREPROCESS,
+    DSP_UPMIX,
+    DSP_RESAMPLE,       /* both directions, when the device rate differs */
+    DSP_STAGES,
+};
+
+static const char *dsp_stage_name[DSP_STAGES] = {
+    "period", "mix", "downmix", "echo", "preprocess", "upmix", "resample",
+};
+
+struct dsp_stat {
+    uint64_t ns;        /* thread CPU time */
+    uint64_t calls;
+};
+
+struct pcm_config pcm_config = {
+    .rate = SAMPLE_RATE,
+    .period_frames = PERIOD_FRAMES,
+    .buffer_frames = BUFFER_FRAMES,
+};
+
+struct dsp_config dsp_config = {
+    .aec = 1,
+    .agc = 1,
+    .denoise = 1,
+    .frame_size = 0,
+    .tail = 8192,
+    .stats = 0,
+};
+
+/* A frontend command, handed from the event loop to the worker. */
+struct alsa_cmd {
+    struct alsa_stream *as;
+    struct fe_cmd cmd;
+};
+
+/*
+ * Host side, shared by every attached guest: the ALSA devices, the echo
+ * canceller (its reference is the mixed output) and the guests to mix
+ * into the playback device and feed from the capture one.
+ *
+ * Periods run on a real-time worker thread. The event loop only hands it
+ * commands through a single producer, single consumer queue, and it
+ * hands back period interrupts as per-guest flags plus an eventfd, so
+ * neither side blocks on the other. host.lock only guards attaching and
+ * detaching guests against a running period.
+ */
+static struct alsa_host {
+    pthread_mutex_t lock;
+    struct alsa_device p;
+    struct alsa_device c;
+    struct xen_vsnd_backend *backends;
+    int primed;
+    int rate;
+    int period_frames;  /* smallest guest period when the devices opened */
+    int buffer_frames;
+    int frame_size;     /* speex block, divides the period */
+    int tail;           /* echo canceller tail, at least one block */
+
+    /*
+     * The devices run at hw_rate. When it isn't the guests' rate, capture
+     * is converted into input, which then holds up to in_max frames and
+     * gives guest periods as they fill, and each mixed period is converted
+     * to hw_output on its way out.
+     */
+    int hw_rate;
+    int hw_period_frames;
+    struct resampler *rs_in;
+    struct resampler *rs_out;
+    int16_t *hw_input;
+    int16_t *hw_output;
+    int in_fill;
+    int in_max;
+
+    /*
+     * The card's clock, tracked against the capture position and its
+     * ALSA timestamp each period; playback is taken to share it. edge is
+     * the filtered guest time (xc_hvm_get_time) the last frame read was
+     * captured at, and every guest position is published against it.
+     */
+    struct dll clock;
+    uint64_t captured;  /* frames read since the device started */
+    int tstamp_clock;   /* the timestamps' clockid_t, -1 until known */
+    uint64_t edge;
+    uint32_t rate_mhz;  /* the guests' rate as the card runs it */
+
+    /* One period each, sized when the devices open. Stereo unless noted. */
+    int16_t *input;     /* raw capture */
+    int16_t *clean;     /* processed capture */
+    int16_t *output;    /* the mix */
+    int16_t *guest;     /* one guest's playback */
+    int16_t *silence;
+    int16_t *mono;      /* capture downmix, then echo cancelled (mono) */
+    int16_t *mono_clean;
+    int16_t *echo_ref[2]; /* output downmix, last two periods (mono) */
+
+    SpeexEchoState *echo_state;
+    SpeexPreprocessState *preprocess_state;
+    int echo_live;      /* echo reference kept up to date */
+
+    uint64_t periods;
+    struct dsp_stat stats[DSP_STAGES];
+    unsigned int playback_xruns;
+    unsigned int capture_xruns;
+
+    pthread_t worker;
+    int running;
+    int open;           /* devices open and the worker started */
+    int stopping;
+    int kick_fd;        /* wakes the worker: commands queued, or stop */
+    int notify_fd;      /* wakes the event loop: period interrupts due */
+    struct event notify_event;
+
+    struct alsa_cmd cmds[ALSA_CMD_QUEUE];
+    unsigned int cmd_prod, cmd_cons;
+} host = {
+    .kick_fd = -1,
+    .notify_fd = -1,
+    .tstamp_clock = -1,
+};
+
+static void host_lock(void)
+{
+    pthread_mutex_lock(&host.lock);
+}
+
+static void host_unlock(void)
+{
+    pthread_mutex_unlock(&host.lock);
+}
+
+static void host_kick(int fd)
+{
+    uint64_t v = 1;
+
+    if (write(fd, &v, sizeof(v)) != sizeof(v))
+	printf("%s: %s\n", __FUNCTION__, strerror(errno));
+}
+
+/* Worker side: ask the event loop to send the guest its interrupt. */
+static void alsa_notify(struct alsa_stream *as)
+{
+    __atomic_store_n(&as->xvb->period_pending, 1, __ATOMIC_RELEASE);
+}
 
+/* Worker side, host.lock held. seq is odd while the page is inconsistent. */
 void refresh_be_info(struct alsa_stream *as, int hw_ptr, int delay,
 		     uint64_t s_time, int status)
 {
     struct be_info *be_info = as->be_info;
 
+    be_info->seq++;
+    wmb();
     be_info->hw_ptr = hw_ptr;
     be_info->delay = delay;
     be_info->s_time = s_time;
     be_info->status = status;
+    be_info->rate_mhz = status == STREAM_STARTED ? host.rate_mhz : 0;
+    wmb();
+    be_info->seq++;
 
     wmb();
 }
 
-void alsa_refresh_be_playback_info(struct alsa_stream *as, int periods)
+/* queued: frames the device still holds ahead of the period just mixed. */
+void alsa_refresh_be_playback_info(struct alsa_stream *as, int periods,
+				   int queued)
 {
-    uint64_t time_nsec;
-    snd_pcm_sframes_t delay;
     int pointer;
-    
-    time_nsec = get_nsec_now();
 
-    pointer = as->hw_ptr/4;
-    pointer -= (1024 * periods);
-    if (pointer < 0)
-	pointer += (N_AUD_BUFFER_PAGES * 1024);
-    pointer %= (N_AUD_BUFFER_PAGES * 1024);
+    pointer = as->hw_ptr / FRAME_BYTES;
+    pointer -= (host.period_frames * periods);
+    while (pointer < 0)
+	pointer += as->buffer_frames;
+    pointer %= as->buffer_frames;
 
-    refresh_be_info(as, pointer, 0, time_nsec, STREAM_STARTED);
+    refresh_be_info(as, pointer, queued, host.edge, STREAM_STARTED);
 }
 
-void alsa_refresh_be_capture_info(struct alsa_stream *as)
+/* held: frames captured before edge that this guest hasn't had yet. */
+void alsa_refresh_be_capture_info(struct alsa_stream *as, int held)
 {
-    uint64_t time_nsec;
-    snd_pcm_sframes_t delay;
-    
-    time_nsec = get_nsec_now();
-    refresh_be_info(as, as->hw_ptr/4, 0, time_nsec, STREAM_STARTED);
+    refresh_be_info(as, as->hw_ptr / FRAME_BYTES, held, host.edge,
+		    STREAM_STARTED);
 }
 
 static void get_data_from_sg(int16_t *dst, int size, struct alsa_stream *as)
 {
-    int16_t *src;
-    int val, vol;
-
-    val = 100; //as->vol_l;
-    if (val < 1)
-	val = 1;
-
-    size = size / 2;
-   
-    while (size--) {
-	src = as->dma_buffer[as->hw_ptr / XENVSND_PAGE_SIZE] + as->hw_ptr % XENVSND_PAGE_SIZE;
-	*dst++ = (*src) * val / 100;
-
-	as->processed += 2;
-	as->hw_ptr += 2;
-	if (as->hw_ptr == XENVSND_PAGE_SIZE * N_AUD_BUFFER_PAGES) {
-	    as->hw_ptr = 0;
-	}
-    }
-    return;   
+    size &= ~1;
+    as->hw_ptr = sg_read(dst, as->dma_buffer, as->buffer_frames * FRAME_BYTES,
+			 as->hw_ptr, size, as->gain_l, as->gain_r);
+    as->processed += size;
 }
 
-static void put_data_to_sg(int16_t *dst, int size, struct alsa_stream *as)
+static void put_data_to_sg(int16_t *src, int size, struct alsa_stream *as)
 {
-    int16_t *src;
-    int val, vol;
-
-    val = 100; //as->vol_l;
-    if (val < 1)
-	val = 1;
-
-    size = size / 2;
-
-    while (size--) {
-	src = as->dma_buffer[as->hw_ptr / XENVSND_PAGE_SIZE] + as->hw_ptr % XENVSND_PAGE_SIZE;
-	*src = (*dst++) * val / 100;
-
-	as->processed += 2;
-	as->hw_ptr += 2;
-	if (as->hw_ptr == XENVSND_PAGE_SIZE * N_AUD_BUFFER_PAGES) {
-	    as->hw_ptr = 0;
-	}
-    }
-    return;    
+    size &= ~1;
+    as->hw_ptr = sg_write(as->dma_buffer, as->buffer_frames * FRAME_BYTES,
+			  as->hw_ptr, src, size, as->gain_l, as->gain_r);
+    as->processed += size;
 }
 
 static int set_hwparams(snd_pcm_t *handle,
 			snd_pcm_hw_params_t *params,
 			snd_pcm_access_t access,
+			unsigned int *rate,
 			int period_frames,
 			int buffer_frames)
 {
@@ -187,19 +316,21 @@ static int set_hwparams(snd_pcm_t *handle,
 	return err;
     }
     /* set the stream rate */
-    rrate = SAMPLE_RATE;
+    rrate = *rate;
     err = snd_pcm_hw_params_set_rate_near(handle, params, &rrate, 0);
     if (err < 0) {
-	printf("Rate %iHz not available for playback: %s\n", SAMPLE_RATE, snd_strerror(err));
+	printf("Rate %iHz not available for playback: %s\n", *rate, snd_strerror(err));
 	return err;
     }
-    if (rrate != SAMPLE_RATE) {
-	printf("Rate doesn't match (requested %iHz, get %iHz)\n", SAMPLE_RATE, err);
+    if (rrate != *rate) {
+	/* Hand back the rate on offer, the caller may convert to it. */
+	printf("Rate doesn't match (requested %iHz, get %iHz)\n", *rate, rrate);
+	*rate = rrate;
 	return -EINVAL;
     }
     err = snd_pcm_hw_params_set_buffer_size(handle, params, buffer_frames);
     if (err < 0) {
-	printf("Unable to set buffer time %i for playback: %s\n", 2048, snd_strerror(err));
+	printf("Unable to set buffer time %i for playback: %s\n", buffer_frames, snd_strerror(err));
 	return err;
     }
     err = snd_pcm_hw_params_get_buffer_size(params, &size);
@@ -264,15 +395,20 @@ static int set_swparams(snd_pcm_t *handle, snd_pcm_sw_params_t *swparams)
 
 static int xrun_recovery(snd_pcm_t *handle, int err)
 {
-    printf("stream recovery\n");
     if (err == -EPIPE) {	/* under-run */
 	err = snd_pcm_prepare(handle);
 	if (err < 0)
 	    printf("Can't recovery from underrun, prepare failed: %s\n", snd_strerror(err));
 	return 0;
     } else if (err == -ESTRPIPE) {
-	while ((err = snd_pcm_resume(handle)) == -EAGAIN)
-	    sleep(1);	/* wait until the suspend flag is released */
+	/*
+	 * -EAGAIN until the suspend flag is released. Not waited for here,
+	 * on the real-time worker with host.lock held: the worker tries
+	 * again on its next wakeup.
+	 */
+	err = snd_pcm_resume(handle);
+	if (err == -EAGAIN)
+	    return err;
 	if (err < 0) {
 	    err = snd_pcm_prepare(handle);
 	    if (err < 0)
@@ -285,330 +421,1097 @@ static int xrun_recovery(snd_pcm_t *handle, int err)
 
 static int alsa_prepare(struct alsa_stream *as)
 {
-    pthread_mutex_lock(&as->mutex);   
-    snd_pcm_prepare(as->handle);
     as->hw_ptr = as->processed = as->processed_periods = 0;
-    pthread_mutex_unlock(&as->mutex);   
     return 0;
 }
 
 
 int alsa_get_live_frames(struct alsa_stream *as)
 {
-    int app_ptr, pv_avail;
-    
-    rmb();
-    app_ptr = as->be_info->appl_ptr;
-    while (app_ptr != as->be_info->appl_ptr)
-	app_ptr=as->be_info->appl_ptr;
+    int app_ptr;
+
+    /* A single 64 bit load even on 32 bit dom0, so it cannot tear. */
+    app_ptr = __atomic_load_n(&as->be_info->appl_ptr, __ATOMIC_ACQUIRE);
+    return app_ptr - as->processed / FRAME_BYTES;
+}
+
+static int64_t alsa_clock_ns(int clock)
+{
+    struct timespec ts;
 
-    pv_avail = app_ptr - as->processed/4;
-    return pv_avail;
+    clock_gettime(clock, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
 }
 
-char null_buffer[4096] = {0};
-char prev_buf_1[4096] = {0};
-char prev_buf_2[4096] = {0};
-char mono_input[4096] = {0};
+/*
+ * One capture period read: feed the loop the position the device had
+ * when it took the timestamp, avail frames past what was read before,
+ * and work out edge. Depending on alsa-lib and the kernel the timestamps
+ * are either gettimeofday() or monotonic; whichever is nearer now is it.
+ * A device that gives none is timestamped here instead.
+ */
+static void alsa_clock(snd_pcm_uframes_t avail, snd_htimestamp_t *ts, int read)
+{
+    int64_t t, real, mono;
+    double ratio;
+
+    t = ts->tv_sec * 1000000000LL + ts->tv_nsec;
+    if (host.tstamp_clock < 0 || !t) {
+	real = alsa_clock_ns(CLOCK_REALTIME);
+	mono = alsa_clock_ns(CLOCK_MONOTONIC);
+	if (!t) {
+	    host.tstamp_clock = CLOCK_MONOTONIC;
+	    t = mono;
+	} else {
+	    host.tstamp_clock = llabs(real - t) < llabs(mono - t) ?
+		CLOCK_REALTIME : CLOCK_MONOTONIC;
+	}
+    }
+
+    dll_update(&host.clock, host.captured + avail, t);
+    host.captured += read;
+
+    host.edge = get_nsec_now() + dll_time(&host.clock, host.captured) -
+	alsa_clock_ns(host.tstamp_clock);
+    ratio = dll_ratio(&host.clock);
+    host.rate_mhz = llrint(host.rate * ratio * 1000);
+}
 
-static void fill_averege(int16_t *src, int16_t *dst)
+static void fill_averege(int16_t *src, int16_t *dst, int frames)
 {
     int i;
-    for (i=0; i<2048; i+=2) {
+    for (i=0; i<frames*2; i+=2) {
 	dst[i/2] = (src[i] + src[i+1])/2;
     }
 }
 
-static void double_mono(int16_t *src, int16_t *dst)
+static void double_mono(int16_t *src, int16_t *dst, int frames)
 {
     int i;
-    for (i=0; i<2048; i+=2) {
+    for (i=0; i<frames*2; i+=2) {
 	dst[i] = dst[i+1] = src[i/2];
     }
 }
 
-int number = 0;
-static void alsa_repare(struct xen_vsnd_backend *xvb)
+static uint64_t dsp_clock(void)
 {
-    snd_pcm_drop(xvb->p.handle);
-    snd_pcm_drop(xvb->c.handle);
-    snd_pcm_resume(xvb->p.handle);
-    snd_pcm_resume(xvb->c.handle);
-    snd_pcm_prepare(xvb->p.handle);
-    snd_pcm_prepare(xvb->c.handle);
-    number = 0;
-    snd_pcm_start(xvb->c.handle);
+    struct timespec ts;
+
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
 }
 
-static void capture_callback(snd_async_handler_t *ahandler)
+static void dsp_account(enum dsp_stage stage, uint64_t start)
 {
-    struct xen_vsnd_backend *xvb = snd_async_handler_get_callback_private(ahandler);
-    char orig_input[4096];
-    char clean_input[4096];
-    char output_frame[4096];
-    int generate_period = 0;
-    struct alsa_stream *as;
-    int read, written;
-    int avail;
+    host.stats[stage].ns += dsp_clock() - start;
+    host.stats[stage].calls++;
+}
 
-    if (number == 0) {
-    	written = snd_pcm_writei(xvb->p.handle, null_buffer, 1024);
-    	written = snd_pcm_writei(xvb->p.handle, null_buffer, 1024);
-    	written = snd_pcm_writei(xvb->p.handle, null_buffer, 1024);
-    	number = 1;
+static void alsa_dsp_report(void)
+{
+    double period_ns = host.hw_period_frames * 1e9 / host.hw_rate;
+    struct dsp_stat *st;
+    int i;
+
+    printf("dsp: %llu periods of %d, aec %d agc %d denoise %d, frame %d tail %d\n",
+	   (unsigned long long)host.periods, host.period_frames, dsp_config.aec,
+	   dsp_config.agc, dsp_config.denoise, host.frame_size, host.tail);
+    for (i = 0; i < DSP_STAGES; i++) {
+	st = &host.stats[i];
+	if (!st->calls)
+	    continue;
+	printf("  %-10s %10llu calls %8.1f us/call %6.2f%% of real time\n",
+	       dsp_stage_name[i], (unsigned long long)st->calls,
+	       st->ns / 1e3 / st->calls,
+	       100.0 * st->ns / (host.periods * period_ns));
     }
+    printf("  clock      %+.1f ppm, guests run at %u.%03uHz\n",
+	   (dll_ratio(&host.clock) - 1) * 1e6, host.rate_mhz / 1000,
+	   host.rate_mhz % 1000);
+    printf("  xruns      %u playback, %u capture\n", host.playback_xruns,
+	   host.capture_xruns);
+}
 
-    as = &xvb->c;
-    avail = snd_pcm_avail(as->handle);
+/*
+ * Echo cancellation and preprocessing of one capture period, in place,
+ * frame_size frames at a time. Either stage may be configured out.
+ */
+static void alsa_dsp_run(int16_t *stereo, int frames)
+{
+    int16_t *mono = host.mono;
+    int16_t *clean = host.mono_clean;
+    int n = host.frame_size;
+    uint64_t t;
+    int f;
+
+    t = dsp_clock();
+    fill_averege(stereo, mono, frames);
+    dsp_account(DSP_DOWNMIX, t);
+
+    for (f = 0; f + n <= frames; f += n) {
+	if (host.echo_state) {
+	    t = dsp_clock();
+	    speex_echo_playback(host.echo_state, host.echo_ref[1] + f);
+	    speex_echo_capture(host.echo_state, mono + f, clean + f);
+	    dsp_account(DSP_ECHO, t);
+	} else {
+	    memcpy(clean + f, mono + f, n * sizeof(int16_t));
+	}
+	if (host.preprocess_state) {
+	    t = dsp_clock();
+	    speex_preprocess_run(host.preprocess_state, clean + f);
+	    dsp_account(DSP_PREPROCESS, t);
+	}
+    }
+
+    t = dsp_clock();
+    double_mono(clean, stereo, frames);
+    dsp_account(DSP_UPMIX, t);
+}
+
+/*
+ * The host runs at the smallest period of all guests, so a guest with a
+ * longer one only gets its interrupt once a whole period of its own has
+ * gone through, on the first host period past the boundary.
+ */
+static int alsa_period_elapsed(struct alsa_stream *as)
+{
+    int periods = as->processed / (as->period_frames * FRAME_BYTES);
+
+    if (periods == as->processed_periods)
+	return 0;
+    as->processed_periods = periods;
+    return 1;
+}
+
+/*
+ * Count an xrun against the device and every guest streaming through
+ * it, and bring the device back: prepare after an xrun, resume after a
+ * suspend, or as a last resort drop it and prepare again. The other
+ * direction keeps running.
+ */
+static void alsa_xrun(struct alsa_device *dev, int err)
+{
+    struct xen_vsnd_backend *xvb;
+    int capture = dev == &host.c;
+
+    /* Still the suspend already counted, only the resume is retried. */
+    if (err == -ESTRPIPE && dev->suspended)
+	goto recover;
+
+    printf("%s xrun: %s\n", capture ? "capture" : "playback",
+	   snd_strerror(err));
+    if (capture)
+	host.capture_xruns++;
+    else
+	host.playback_xruns++;
+    for (xvb = host.backends; xvb; xvb = xvb->next) {
+	if (capture && xvb->c.running)
+	    __atomic_add_fetch(&xvb->capture_xruns, 1, __ATOMIC_RELAXED);
+	else if (!capture && xvb->p.running)
+	    __atomic_add_fetch(&xvb->playback_xruns, 1, __ATOMIC_RELAXED);
+	else
+	    continue;
+	__atomic_add_fetch(&xvb->xrun_gen, 1, __ATOMIC_RELEASE);
+    }
+
+recover:
+    err = xrun_recovery(dev->handle, err);
+    dev->suspended = err == -EAGAIN;
+    if (err < 0 && !dev->suspended) {
+	snd_pcm_drop(dev->handle);
+	snd_pcm_prepare(dev->handle);
+    }
+}
+
+/* Capture restarts empty; the clock has lost its place too. */
+static void alsa_recover_capture(int err)
+{
+    alsa_xrun(&host.c, err);
+    host.in_fill = 0;
+    host.captured = 0;
+    dll_reset(&host.clock);
+    if (host.rs_in)
+	resampler_reset(host.rs_in);
+    snd_pcm_start(host.c.handle);
+}
+
+/* Playback restarts on the next write, after a refill. */
+static void alsa_recover_playback(int err)
+{
+    alsa_xrun(&host.p, err);
+    if (host.rs_out)
+	resampler_reset(host.rs_out);
+    host.primed = 0;
+}
+
+static void alsa_drain_cmds(void);
+static void alsa_dsp_init(void);
+
+/*
+ * One period, on the worker: the cleaned capture goes to every guest
+ * capturing, every guest playing is mixed into the output with
+ * saturating adds.
+ */
+static void alsa_guest_period(int16_t *input, int read);
+
+static void alsa_period(void)
+{
+    int frames = host.period_frames;
+    struct xen_vsnd_backend *xvb;
+    int16_t *capture;
+    int read, avail, want_dsp;
+    snd_pcm_uframes_t ts_avail;
+    snd_htimestamp_t ts;
+    uint64_t start = dsp_clock(), t;
+
+    host_lock();
+    alsa_drain_cmds();
+
+    /* Guests that want processed capture, starting or running. */
+    want_dsp = 0;
+    for (xvb = host.backends; xvb; xvb = xvb->next)
+	if (xvb->c.running && xvb->c.dsp)
+	    want_dsp = 1;
+    if (want_dsp && host.echo_state && !host.echo_live) {
+	memset(host.echo_ref[0], 0, frames * sizeof(int16_t));
+	memset(host.echo_ref[1], 0, frames * sizeof(int16_t));
+	speex_echo_state_reset(host.echo_state);
+    }
+    host.echo_live = want_dsp && host.echo_state;
+
+    avail = snd_pcm_avail(host.c.handle);
     if (avail < 0) {
-	printf("restarting for avail=%d\n", avail);
-	alsa_repare(xvb);
-	return;
+	alsa_recover_capture(avail);
+	goto out;
     }
 
-    if (avail < 1024)
-	return;
+    if (avail < host.hw_period_frames)
+	goto out;
+
+    /* The position and timestamp of the hwsync snd_pcm_avail() did. */
+    if (snd_pcm_htimestamp(host.c.handle, &ts_avail, &ts) < 0) {
+	ts_avail = avail;
+	ts.tv_sec = ts.tv_nsec = 0;
+    }
 
-    read = snd_pcm_readi(as->handle, orig_input, PERIOD_FRAMES);
+    capture = host.rs_in ? host.hw_input : host.input;
+    read = snd_pcm_readi(host.c.handle, capture, host.hw_period_frames);
     if (read < 0) {
-	printf("restarting for read=%d\n", read);
-	alsa_repare(xvb);
-	return;
+	alsa_recover_capture(read);
+	goto out;
     }
-    pthread_mutex_lock(&as->mutex);
-    if (capture_is_running > 1) {
+    alsa_clock(ts_avail, &ts, read);
 
-	fill_averege(orig_input, mono_input);
+    if (!host.rs_in) {
+	alsa_guest_period(host.input, read);
+	goto out;
+    }
 
-	speex_echo_playback(echo_state, prev_buf_2); 
-	speex_echo_capture(echo_state, mono_input, clean_input); 
-	speex_preprocess_run(preprocess_state, clean_input); 
+    /* Converted capture gives a guest period once enough has built up. */
+    t = dsp_clock();
+    host.in_fill += resampler_process(host.rs_in, host.hw_input, read,
+				      host.input + host.in_fill * 2);
+    dsp_account(DSP_RESAMPLE, t);
+    while (host.in_fill >= frames) {
+	alsa_guest_period(host.input, frames);
+	host.in_fill -= frames;
+	memmove(host.input, host.input + frames * 2,
+		host.in_fill * FRAME_BYTES);
+    }
 
-	double_mono(clean_input, orig_input);
+out:
+    dsp_account(DSP_PERIOD, start);
+    host.periods++;
+    host_unlock();
+    host_kick(host.notify_fd);
 
-	put_data_to_sg((uint16_t *)orig_input, read * 4, as);
-	alsa_refresh_be_capture_info(as);
-	generate_period = 1;
-    } else if (capture_is_running == 1){
-	capture_is_running = 2;
-	/* nothing else to do */
+    if (dsp_config.stats && host.periods % dsp_config.stats == 0)
+	alsa_dsp_report();
+}
+
+/*
+ * Mix one period of every guest with enough queued into host.output and
+ * interrupt those whose period is up. queued is how far ahead of it the
+ * device is, for be_info. Returns how many guests were mixed.
+ */
+static int alsa_mix(int queued)
+{
+    int frames = host.period_frames;
+    int bytes = frames * FRAME_BYTES;
+    struct xen_vsnd_backend *xvb;
+    struct alsa_stream *as;
+    int mixed = 0;
+    uint64_t t = dsp_clock();
+
+    for (xvb = host.backends; xvb; xvb = xvb->next) {
+	as = &xvb->p;
+	if (as->running && alsa_get_live_frames(as) >= frames) {
+	    if (!mixed) {
+		get_data_from_sg(host.output, bytes, as);
+	    } else {
+		get_data_from_sg(host.guest, bytes, as);
+		sg_mix_s16(host.output, host.guest, frames * 2);
+	    }
+	    mixed++;
+	    as->dry = 0;
+
+	    if (as->running < 2) {
+		as->running++;
+	    } else if (alsa_period_elapsed(as)) {
+		alsa_refresh_be_playback_info(as, 1, queued);
+		alsa_notify(as);
+	    }
+	} else if (as->running == 2 && !as->dry) {
+	    /* Counted once per gap, not per silent period. */
+	    as->dry = 1;
+	    __atomic_add_fetch(&xvb->starved, 1, __ATOMIC_RELAXED);
+	    __atomic_add_fetch(&xvb->xrun_gen, 1, __ATOMIC_RELEASE);
+	}
     }
-    pthread_mutex_unlock(&as->mutex);
+    if (!mixed)
+	memcpy(host.output, host.silence, bytes);
+    dsp_account(DSP_MIX, t);
 
-    as = &xvb->p;
-    avail = snd_pcm_avail(as->handle);
-    if (avail < 0) {
-	printf("restarting for avail=%d\n", avail);
-	alsa_repare(xvb);
-	return;
+    return mixed;
+}
+
+/* host.output to the device, converted if need be. */
+static int alsa_play(void)
+{
+    int16_t *output = host.output;
+    int n = host.period_frames;
+    uint64_t t;
+
+    if (host.rs_out) {
+	t = dsp_clock();
+	n = resampler_process(host.rs_out, host.output, n, host.hw_output);
+	output = host.hw_output;
+	dsp_account(DSP_RESAMPLE, t);
     }
-    pthread_mutex_lock(&as->mutex);
-    if ((playback_is_running == 0) || (alsa_get_live_frames(as) < 1024) ) {
-	memcpy(output_frame, null_buffer, 4096);
-    } else {
-	get_data_from_sg((uint16_t *)output_frame, PERIOD_FRAMES * 4, as);
- 
-	if(playback_is_running < 2) {
-	    playback_is_running++;
-	} else {
-	    alsa_refresh_be_playback_info(as, 1);
-	    generate_period = 1;
+    return snd_pcm_writei(host.p.handle, output, n);
+}
+
+static int alsa_queued(int avail)
+{
+    int queued = (int64_t)(host.buffer_frames - avail) * host.rate /
+	host.hw_rate;
+
+    return queued < 0 ? 0 : queued;
+}
+
+/*
+ * Queue all but one period of the device buffer, as at the start or
+ * after an underrun: from what the guests have queued as far as it goes,
+ * so an underrun costs them as little as it can, then silence.
+ */
+static void alsa_refill(void)
+{
+    int i, err;
+
+    for (i = 1; i < HOST_BUFFER_PERIODS; i++) {
+	if (alsa_mix(alsa_queued(host.buffer_frames - (i - 1) *
+				 host.hw_period_frames)))
+	    err = alsa_play();
+	else
+	    err = snd_pcm_writei(host.p.handle, host.silence,
+				 host.hw_period_frames);
+	if (err < 0) {
+	    alsa_recover_playback(err);
+	    return;
+	}
+    }
+    host.primed = 1;
+}
+
+/*
+ * One guest period of read frames at the guests' rate: the capture in
+ * input goes to the guests, their playback is mixed and written out.
+ */
+static void alsa_guest_period(int16_t *input, int read)
+{
+    int frames = host.period_frames;
+    struct xen_vsnd_backend *xvb;
+    struct alsa_stream *as;
+    int16_t *swap;
+    int avail, cleaned, written, held;
+    uint64_t t;
+
+    /* Converted capture still in input after this period. */
+    held = host.rs_in ? host.in_fill - read : 0;
+
+    /* Raw capture stays in input for the guests that want it. */
+    cleaned = 0;
+    for (xvb = host.backends; xvb; xvb = xvb->next) {
+	as = &xvb->c;
+	if (as->running > 1) {
+	    if (as->dsp && !cleaned) {
+		memcpy(host.clean, input, read * FRAME_BYTES);
+		alsa_dsp_run(host.clean, read);
+		cleaned = 1;
+	    }
+
+	    put_data_to_sg(as->dsp ? host.clean : input,
+			   read * FRAME_BYTES, as);
+	    if (alsa_period_elapsed(as)) {
+		alsa_refresh_be_capture_info(as, held);
+		alsa_notify(as);
+	    }
+	} else if (as->running == 1) {
+	    as->running = 2;
+	    /* nothing else to do */
 	}
     }
-    pthread_mutex_unlock(&as->mutex);
 
-    written = snd_pcm_writei(as->handle, output_frame, PERIOD_FRAMES);
+    if (!host.primed)
+	alsa_refill();
+
+    avail = snd_pcm_avail(host.p.handle);
+    if (avail < 0) {
+	alsa_recover_playback(avail);
+	alsa_refill();
+	avail = snd_pcm_avail(host.p.handle);
+	if (avail < 0)
+	    return;
+    }
+
+    alsa_mix(alsa_queued(avail));
+    written = alsa_play();
     if (written < 0) {
-	printf("restarting for snd_pcm_writei: written=%d\n", written);
-	alsa_repare(xvb);
+	/* This period is lost, the next one refills behind it. */
+	alsa_recover_playback(written);
 	return;
     }
-    memcpy(prev_buf_2, prev_buf_1, 2048);
-    fill_averege(output_frame, prev_buf_1);
-
-    if (generate_period)
-	generate_period_interrupt();
 
+    /* The echo reference is only needed while someone captures. */
+    if (host.echo_live) {
+	t = dsp_clock();
+	swap = host.echo_ref[1];
+	host.echo_ref[1] = host.echo_ref[0];
+	host.echo_ref[0] = swap;
+	fill_averege(host.output, host.echo_ref[0], frames);
+	dsp_account(DSP_DOWNMIX, t);
+    }
 }
 
+/*
+ * Real-time worker: sleeps on the capture PCM descriptors, which signal
+ * once per period, and on kick_fd. A period that does not come within a
+ * second still runs, so a wedged device gets recovered. While a device is
+ * suspended the descriptors may stay in error, so it sleeps on kick_fd
+ * alone and runs a period every ALSA_RESUME_MS to retry the resume.
+ */
+static void *alsa_worker(void *arg)
+{
+    struct pollfd fds[ALSA_MAX_POLLFDS + 1];
+    unsigned short revents;
+    uint64_t v;
+    int n, rc, suspended;
+
+    n = snd_pcm_poll_descriptors(host.c.handle, fds, ALSA_MAX_POLLFDS);
+    if (n < 0) {
+	printf("%s: no poll descriptors: %s\n", __FUNCTION__, snd_strerror(n));
+	return NULL;
+    }
+    fds[n].fd = host.kick_fd;
+    fds[n].events = POLLIN;
+
+    while (!__atomic_load_n(&host.stopping, __ATOMIC_ACQUIRE)) {
+	suspended = host.p.suspended || host.c.suspended;
+	if (suspended)
+	    rc = poll(&fds[n], 1, ALSA_RESUME_MS);
+	else
+	    rc = poll(fds, n + 1, 1000);
+	if (rc < 0) {
+	    if (errno == EINTR)
+		continue;
+	    printf("%s: poll: %s\n", __FUNCTION__, strerror(errno));
+	    break;
+	}
 
-int alsa_open(struct alsa_stream *as, struct xen_vsnd_backend *xvb)
+	if (fds[n].revents & POLLIN) {
+	    if (read(host.kick_fd, &v, sizeof(v)) != sizeof(v))
+		continue;
+	    host_lock();
+	    alsa_drain_cmds();
+	    host_unlock();
+	    host_kick(host.notify_fd);
+	}
+
+	if (rc > 0 && !suspended) {
+	    snd_pcm_poll_descriptors_revents(host.c.handle, fds, n, &revents);
+	    if (!(revents & (POLLIN | POLLERR)))
+		continue;
+	}
+	alsa_period();
+    }
+
+    return NULL;
+}
+
+static int alsa_start_worker(void)
 {
+    pthread_attr_t attr;
+    struct sched_param sp;
     int err;
-    int period_frames;
-    int buffer_frames;
 
-    pthread_mutex_lock(&as->mutex);
+    host.stopping = 0;
+
+    pthread_attr_init(&attr);
+    pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+    pthread_attr_setschedpolicy(&attr, SCHED_FIFO);
+    sp.sched_priority = ALSA_WORKER_PRIORITY;
+    pthread_attr_setschedparam(&attr, &sp);
 
-    snd_pcm_hw_params_alloca(&as->hwparams);
-    snd_pcm_sw_params_alloca(&as->swparams);
+    err = pthread_create(&host.worker, &attr, alsa_worker, NULL);
+    if (err == EPERM) {
+	printf("no real-time scheduling, audio worker runs SCHED_OTHER\n");
+	pthread_attr_setinheritsched(&attr, PTHREAD_INHERIT_SCHED);
+	err = pthread_create(&host.worker, &attr, alsa_worker, NULL);
+    }
+    pthread_attr_destroy(&attr);
+
+    if (err) {
+	printf("unable to start the audio worker: %s\n", strerror(err));
+	return -1;
+    }
+    host.running = 1;
+    return 0;
+}
+
+/* Not with host.lock held, the worker may be waiting for it. */
+static void alsa_stop_worker(void)
+{
+    if (!host.running)
+	return;
+
+    __atomic_store_n(&host.stopping, 1, __ATOMIC_RELEASE);
+    host_kick(host.kick_fd);
+    pthread_join(host.worker, NULL);
+    host.running = 0;
+}
+
+
+static int alsa_open(struct alsa_device *dev)
+{
+    int err;
+
+    snd_pcm_hw_params_alloca(&dev->hwparams);
+    snd_pcm_sw_params_alloca(&dev->swparams);
+    dev->suspended = 0;
 
     err = snd_output_stdio_attach(&output, stdout, 0);
     if (err < 0) {
 	printf("Output failed: %s\n", snd_strerror(err));
-	return 0;
+	return -1;
     }
 
-    if (as->stream_type == XC_STREAM_PLAYBACK) {
-	period_frames = P_PERIOD_FRAMES;
-	buffer_frames = P_BUFFER_FRAMES;
-	if ((err = snd_pcm_open(&as->handle, device, SND_PCM_STREAM_PLAYBACK, 0)) < 0) {
+    if (dev->stream_type == XC_STREAM_PLAYBACK) {
+	if ((err = snd_pcm_open(&dev->handle, device, SND_PCM_STREAM_PLAYBACK, 0)) < 0) {
 	    printf("Playback open error: %s\n", snd_strerror(err));
-	    return 0;
+	    return -1;
 	}
     } else {
-	period_frames = C_PERIOD_FRAMES;
-	buffer_frames = C_BUFFER_FRAMES;
-	if ((err = snd_pcm_open(&as->handle, device, SND_PCM_STREAM_CAPTURE, 0)) < 0) {
+	if ((err = snd_pcm_open(&dev->handle, device, SND_PCM_STREAM_CAPTURE, 0)) < 0) {
 	    printf("Capture open error: %s\n", snd_strerror(err));
-	    return 0;
+	    return -1;
 	}
     }
 
-    if ((err = set_hwparams(as->handle, as->hwparams, SND_PCM_ACCESS_RW_INTERLEAVED,
-			    period_frames, buffer_frames)) < 0) {
+    /* The period comes from a guest now, so refusing it is not fatal. */
+    if ((err = set_hwparams(dev->handle, dev->hwparams, SND_PCM_ACCESS_RW_INTERLEAVED,
+			    &dev->rate, host.hw_period_frames, host.buffer_frames)) < 0) {
 	printf("Setting of p_hwparams failed: %s\n", snd_strerror(err));
-	exit(EXIT_FAILURE);
+	return -1;
     }
-    if ((err = set_swparams(as->handle, as->swparams)) < 0) {
+    if ((err = set_swparams(dev->handle, dev->swparams)) < 0) {
 	printf("Setting of p_swparams failed: %s\n", snd_strerror(err));
-	exit(EXIT_FAILURE);
+	return -1;
     }
 
-    if (as->stream_type == XC_STREAM_PLAYBACK) {
-    	/* nothing to do, we only rely on the capture callback */
+    //snd_pcm_dump(dev->handle, output);
+    snd_pcm_prepare(dev->handle);
+    return 0;
+}
+
+static void alsa_close(struct alsa_device *dev)
+{
+    if (dev->handle)
+	snd_pcm_close(dev->handle);
+    dev->handle = NULL;
+}
+
+/* Event loop side: send the interrupts the worker asked for. */
+static void alsa_notify_handler(int fd, short event, void *priv)
+{
+    struct xen_vsnd_backend *xvb;
+    uint64_t v;
+
+    if (read(fd, &v, sizeof(v)) != sizeof(v))
+	return;
+
+    for (xvb = host.backends; xvb; xvb = xvb->next) {
+	if (__atomic_exchange_n(&xvb->period_pending, 0, __ATOMIC_ACQUIRE))
+	    generate_period_interrupt(&xvb->p);
+	v = __atomic_load_n(&xvb->xrun_gen, __ATOMIC_ACQUIRE);
+	if (v != xvb->xrun_published) {
+	    xvb->xrun_published = v;
+	    publish_xruns(xvb);
+	}
+    }
+}
+
+static void alsa_dsp_free(void)
+{
+    if (host.echo_state)
+	speex_echo_state_destroy(host.echo_state);
+    if (host.preprocess_state)
+	speex_preprocess_state_destroy(host.preprocess_state);
+    host.echo_state = NULL;
+    host.preprocess_state = NULL;
+    host.echo_live = 0;
+}
+
+static void alsa_free_buffers(void)
+{
+    resampler_free(host.rs_in);
+    resampler_free(host.rs_out);
+    host.rs_in = host.rs_out = NULL;
+    free(host.input);
+    host.input = NULL;
+}
+
+/*
+ * Size the devices' period for hw_rate, set up the converters if the
+ * guests' rate differs, and allocate all the period buffers in one block.
+ */
+static int alsa_alloc_buffers(void)
+{
+    int frames = host.period_frames;
+    int hw_frames, out_frames, stereo, mono;
+    int16_t *p;
+
+    alsa_free_buffers();
+
+    host.hw_period_frames = ((int64_t)frames * host.hw_rate + host.rate - 1) /
+	host.rate;
+    host.buffer_frames = host.hw_period_frames * HOST_BUFFER_PERIODS;
+    host.in_fill = 0;
+    host.in_max = frames;
+    out_frames = 0;
+    if (host.hw_rate != host.rate) {
+	host.rs_in = resampler_new(host.hw_rate, host.rate, host.hw_period_frames);
+	host.rs_out = resampler_new(host.rate, host.hw_rate, frames);
+	if (!host.rs_in || !host.rs_out)
+	    return -1;
+	host.in_max += resampler_max_out(host.rs_in, host.hw_period_frames);
+	out_frames = resampler_max_out(host.rs_out, frames);
+    }
+
+    hw_frames = host.hw_period_frames > frames ? host.hw_period_frames : frames;
+    stereo = frames * 2;
+    mono = frames;
+    p = calloc(host.in_max * 2 + 3 * stereo + hw_frames * 2 +
+	       (host.rs_in ? host.hw_period_frames * 2 + out_frames * 2 : 0) +
+	       4 * mono, sizeof(int16_t));
+    if (!p)
+	return -1;
+
+    host.input = p;
+    host.clean = p += host.in_max * 2;
+    host.output = p += stereo;
+    host.guest = p += stereo;
+    host.silence = p += stereo;
+    host.mono = p += hw_frames * 2;
+    host.mono_clean = p += mono;
+    host.echo_ref[0] = p += mono;
+    host.echo_ref[1] = p += mono;
+    p += mono;
+    if (host.rs_in) {
+	host.hw_input = p;
+	host.hw_output = p + host.hw_period_frames * 2;
     } else {
-    	err = snd_async_add_pcm_handler(&as->ahandler, as->handle, capture_callback, xvb);
-    	if (err < 0) {
-    	    printf("Unable to register async handler\n");
-    	    exit(EXIT_FAILURE);
-    	}
+	host.hw_input = host.hw_output = NULL;
     }
+    return 0;
+}
 
-    //snd_pcm_dump(as->handle, output);
-    pthread_mutex_unlock(&as->mutex);
+static void alsa_host_close(void)
+{
+    host.open = 0;
+    alsa_stop_worker();
+    if (host.periods)
+	alsa_dsp_report();
+    alsa_dsp_free();
+    alsa_free_buffers();
+    if (host.notify_fd >= 0) {
+	event_del(&host.notify_event);
+	close(host.notify_fd);
+	host.notify_fd = -1;
+    }
+    if (host.kick_fd >= 0) {
+	close(host.kick_fd);
+	host.kick_fd = -1;
+    }
+    alsa_close(&host.p);
+    alsa_close(&host.c);
 }
 
-void init_alsa(struct xen_vsnd_backend *xvb)
+/*
+ * Open the host devices and start the worker. Guests run at pcm_config's
+ * rate and period_frames; the devices at the hardware rate, which is the
+ * one asked for with -H, or else whatever they offer for the guests' rate.
+ */
+static int alsa_host_open(int period_frames)
 {
-    struct alsa_stream *as;
-    int written;
+    static int lock_ready;
+    pthread_mutexattr_t attr;
+    unsigned int rate;
+    int tries;
+
+    host.rate = pcm_config.rate;
+    host.hw_rate = pcm_config.hw_rate ? pcm_config.hw_rate : pcm_config.rate;
+    host.period_frames = period_frames;
+    host.periods = 0;
+    memset(host.stats, 0, sizeof(host.stats));
+    host.playback_xruns = host.capture_xruns = 0;
+
+    /* The event loop takes this lock too; don't let it invert the worker. */
+    if (!lock_ready) {
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_setprotocol(&attr, PTHREAD_PRIO_INHERIT);
+	pthread_mutex_init(&host.lock, &attr);
+	pthread_mutexattr_destroy(&attr);
+	lock_ready = 1;
+    }
 
-    printf("init_alsa\n");
+    alsa_dsp_init();
 
-    as = &xvb->p;
-    as->stream_type = XC_STREAM_PLAYBACK;
-    alsa_open(as, xvb);
-    alsa_prepare(as);
+    host.kick_fd = eventfd(0, EFD_CLOEXEC);
+    host.notify_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (host.kick_fd < 0 || host.notify_fd < 0) {
+	printf("eventfd: %s\n", strerror(errno));
+	goto fail;
+    }
+    event_set(&host.notify_event, host.notify_fd, EV_READ | EV_PERSIST,
+	      alsa_notify_handler, NULL);
+    event_add(&host.notify_event, NULL);
+
+    host.p.stream_type = XC_STREAM_PLAYBACK;
+    host.c.stream_type = XC_STREAM_CAPTURE;
+    for (tries = 0; ; tries++) {
+	if (alsa_alloc_buffers())
+	    goto fail;
+	printf("opening %s at %dHz, %d frame periods (gain kernel %s)\n",
+	       device, host.hw_rate, host.hw_period_frames, sg_kernel_name());
+
+	host.p.rate = host.c.rate = host.hw_rate;
+	if (!alsa_open(&host.p) && !alsa_open(&host.c))
+	    break;
+	alsa_close(&host.p);
+	alsa_close(&host.c);
+
+	/* Try once more at the rate the device came back with. */
+	rate = host.p.rate != host.hw_rate ? host.p.rate : host.c.rate;
+	if (tries || rate == host.hw_rate)
+	    goto fail;
+	host.hw_rate = rate;
+    }
+    if (host.rs_in)
+	printf("converting %dHz to %dHz (%s)\n", host.rate, host.hw_rate,
+	       resample_kernel_name());
+
+    dll_init(&host.clock, host.hw_rate);
+    host.captured = 0;
+    host.tstamp_clock = -1;
+    host.edge = 0;
+    host.rate_mhz = host.rate * 1000;
+
+    //snd_pcm_link(host.c.handle, host.p.handle);
+
+    host.primed = 0;
+    snd_pcm_start(host.c.handle);
+    if (alsa_start_worker())
+	goto fail;
+    host.open = 1;
+    return 0;
+
+fail:
+    alsa_host_close();
+    return -1;
+}
+
+/* Called on the worker, or before the stream runs. */
+static void alsa_update_gain(struct alsa_stream *as)
+{
+    as->gain_l = as->mute_l ? 0 : as->vol_l * SG_GAIN_UNITY / XC_VOLUME_MAX;
+    as->gain_r = as->mute_r ? 0 : as->vol_r * SG_GAIN_UNITY / XC_VOLUME_MAX;
+}
 
-    as = &xvb->c;
-    as->stream_type = XC_STREAM_CAPTURE;
-    alsa_open(as, xvb);
+static void alsa_init_stream(struct alsa_stream *as, struct xen_vsnd_backend *xvb,
+			     int stream_type)
+{
+    as->stream_type = stream_type;
+    as->xvb = xvb;
+    as->running = 0;
+    as->vol_l = as->vol_r = XC_VOLUME_MAX;
+    as->mute_l = as->mute_r = 0;
+    as->dsp = 1;
+    alsa_update_gain(as);
     alsa_prepare(as);
+}
 
-    //snd_pcm_link(xvb->c.handle, xvb->p.handle);
+/*
+ * Settle on the period and buffer the frontend asked for, within what the
+ * DMA ring holds. Anything unusable falls back to the defaults. The buffer
+ * is a whole number of periods, so period interrupts land on the wrap.
+ */
+static void alsa_negotiate(struct xen_vsnd_backend *xvb)
+{
+    int period = xvb->fe_period_frames ? xvb->fe_period_frames :
+	pcm_config.period_frames;
+    int buffer = xvb->fe_buffer_frames ? xvb->fe_buffer_frames :
+	pcm_config.buffer_frames;
+
+    if (period < PERIOD_FRAMES_MIN || period > PERIOD_FRAMES_MAX) {
+	printf("period of %d frames not supported, using %d\n", period,
+	       pcm_config.period_frames);
+	period = pcm_config.period_frames;
+    }
+    if (buffer < 2 * period || buffer > RING_FRAMES || buffer % period) {
+	printf("buffer of %d frames not supported, using %d\n", buffer,
+	       RING_FRAMES - RING_FRAMES % period);
+	buffer = RING_FRAMES - RING_FRAMES % period;
+    }
+    if (xvb->fe_rate && xvb->fe_rate != pcm_config.rate)
+	printf("rate %d not supported, the host runs at %d\n", xvb->fe_rate,
+	       pcm_config.rate);
 
-    snd_pcm_start(xvb->c.handle);
+    xvb->p.period_frames = xvb->c.period_frames = period;
+    xvb->p.buffer_frames = xvb->c.buffer_frames = buffer;
 }
 
+/*
+ * Attach a guest to the host mixer, opening the devices for the first.
+ * A guest wanting shorter periods than the devices run at reopens them.
+ * If a reopen fails both ways, the guests already attached stay on a
+ * closed host until the next attach opens it again for all of them.
+ */
+int init_alsa(struct xen_vsnd_backend *xvb)
+{
+    struct xen_vsnd_backend *b;
+    int period, old, n;
+
+    printf("init_alsa\n");
+
+    alsa_init_stream(&xvb->p, xvb, XC_STREAM_PLAYBACK);
+    alsa_init_stream(&xvb->c, xvb, XC_STREAM_CAPTURE);
+    alsa_negotiate(xvb);
+
+    /* The host runs at the shortest period of everyone attached. */
+    period = xvb->p.period_frames;
+    for (b = host.backends; b; b = b->next)
+	if (b->p.period_frames < period)
+	    period = b->p.period_frames;
+
+    if (host.open && period < host.period_frames) {
+	printf("reopening for %d frame periods\n", period);
+	old = host.period_frames;
+	alsa_host_close();
+	if (alsa_host_open(period)) {
+	    /* Keep the guests already here running if at all possible. */
+	    if (alsa_host_open(old)) {
+		for (n = 0, b = host.backends; b; b = b->next)
+		    n++;
+		printf("unable to reopen %s, %d guests without audio until "
+		       "the next one attaches\n", device, n);
+	    }
+	    return -1;
+	}
+    } else if (!host.open && alsa_host_open(period)) {
+	if (host.backends)
+	    printf("unable to open %s, guests attached stay without audio\n",
+		   device);
+	return -1;
+    }
+
+    host_lock();
+    xvb->period_pending = 0;
+    xvb->next = host.backends;
+    host.backends = xvb;
+    host_unlock();
+
+    return 0;
+}
+
+/* Detach a guest; once this returns its pages are no longer touched. */
 void cleanup_alsa(struct xen_vsnd_backend *xvb)
 {
-    struct alsa_stream *as;
+    struct xen_vsnd_backend **pp;
+    int last = 0;
 
     printf("cleanup_alsa\n");
 
-    as = &xvb->p;
-    as->stream_type = XC_STREAM_PLAYBACK;
-    snd_pcm_close(as->handle);
+    host_lock();
+    /* Commands still queued may point at this guest. */
+    alsa_drain_cmds();
+    for (pp = &host.backends; *pp; pp = &(*pp)->next) {
+	if (*pp == xvb) {
+	    *pp = xvb->next;
+	    xvb->next = NULL;
+	    last = !host.backends;
+	    break;
+	}
+    }
+    host_unlock();
 
-    as = &xvb->c;
-    as->stream_type = XC_STREAM_CAPTURE;
-    snd_pcm_close(as->handle);
+    if (last && host.open)
+	alsa_host_close();
 }
 
-void init_speex()
+/*
+ * Set up the capture pipeline from dsp_config. The preprocessor also
+ * suppresses the residual echo, so it runs whenever any stage is on.
+ */
+static void alsa_dsp_init(void)
 {
-    int rate=44100;
+    int rate = host.rate;
+    int n = dsp_config.frame_size;
     spx_int32_t tmp;
 
-    echo_state = speex_echo_state_init(1024, 8192);
-    speex_echo_ctl(echo_state, SPEEX_ECHO_SET_SAMPLING_RATE, &rate);
+    if (!n) {
+	n = host.period_frames;
+    } else if (n < 0 || n > host.period_frames || host.period_frames % n) {
+	printf("dsp: frame size %d does not divide the period, using %d\n",
+	       n, host.period_frames);
+	n = host.period_frames;
+    }
+    host.frame_size = n;
+    host.tail = dsp_config.tail < n ? n : dsp_config.tail;
 
-    preprocess_state = speex_preprocess_state_init(1024, 44100);
+    if (dsp_config.aec) {
+	host.echo_state = speex_echo_state_init(n, host.tail);
+	speex_echo_ctl(host.echo_state, SPEEX_ECHO_SET_SAMPLING_RATE, &rate);
+    }
 
-    tmp = 1;
-    speex_preprocess_ctl(preprocess_state, SPEEX_PREPROCESS_SET_AGC, &tmp);
+    if (!dsp_config.aec && !dsp_config.agc && !dsp_config.denoise)
+	return;
+
+    host.preprocess_state = speex_preprocess_state_init(n, host.rate);
+
+    tmp = dsp_config.agc;
+    speex_preprocess_ctl(host.preprocess_state, SPEEX_PREPROCESS_SET_AGC, &tmp);
+
+    tmp = dsp_config.denoise;
+    speex_preprocess_ctl(host.preprocess_state, SPEEX_PREPROCESS_SET_DENOISE, &tmp);
 
-    tmp = 1;
-    speex_preprocess_ctl(preprocess_state, SPEEX_PREPROCESS_SET_DENOISE, &tmp);
+    if (host.echo_state) {
+	tmp = -60;
+	speex_preprocess_ctl(host.preprocess_state, SPEEX_PREPROCESS_SET_ECHO_SUPPRESS, &tmp);
 
-    tmp = -60;
-    speex_preprocess_ctl(preprocess_state, SPEEX_PREPROCESS_SET_ECHO_SUPPRESS, &tmp);
-    
-    tmp = -60;
-    speex_preprocess_ctl(preprocess_state, SPEEX_PREPROCESS_SET_ECHO_SUPPRESS_ACTIVE, &tmp);
+	tmp = -60;
+	speex_preprocess_ctl(host.preprocess_state, SPEEX_PREPROCESS_SET_ECHO_SUPPRESS_ACTIVE, &tmp);
 
-    speex_preprocess_ctl(preprocess_state, SPEEX_PREPROCESS_SET_ECHO_STATE, echo_state);  
-  
+	speex_preprocess_ctl(host.preprocess_state, SPEEX_PREPROCESS_SET_ECHO_STATE, host.echo_state);
+    }
 }
 
-void process_playback_cmd(struct fe_cmd *fe_cmd, struct alsa_stream *as)
+static void process_mixer_cmd(struct fe_cmd *fe_cmd, struct alsa_stream *as)
 {
-    int ret;
-
-    pthread_mutex_lock(&as->mutex);   
     switch (fe_cmd->cmd) {
-    case XC_PCM_OPEN:
-	playback_is_running = 0;
+    case XC_SET_VOLUME:
+	as->vol_l = fe_cmd->data[0] > XC_VOLUME_MAX ? XC_VOLUME_MAX : fe_cmd->data[0];
+	as->vol_r = fe_cmd->data[1] > XC_VOLUME_MAX ? XC_VOLUME_MAX : fe_cmd->data[1];
 	break;
-    case XC_PCM_CLOSE:
-	playback_is_running = 0;
-	break;
-    case XC_PCM_PREPARE:
-	playback_is_running = 0;
-	as->hw_ptr = as->processed = as->processed_periods = 0;
-	break;
-    case XC_TRIGGER_START:
-	refresh_be_info(as, 0, 0, 0, STREAM_STARTING);
-	generate_period_interrupt();
-	playback_is_running = 1;
-	break;
-    case XC_TRIGGER_STOP:
-	refresh_be_info(as, 0, 0, 0, STREAM_STOPPED);
-	generate_period_interrupt();
-	playback_is_running = 0;
+    case XC_SET_MUTE:
+	as->mute_l = !!fe_cmd->data[0];
+	as->mute_r = !!fe_cmd->data[1];
 	break;
     }
-    pthread_mutex_unlock(&as->mutex);   
+    alsa_update_gain(as);
 }
 
-void process_capture_cmd(struct fe_cmd *fe_cmd, struct alsa_stream *as)
+/* Worker side, host.lock held. */
+static void alsa_apply_cmd(struct fe_cmd *fe_cmd, struct alsa_stream *as)
 {
-    int ret;
-
-    pthread_mutex_lock(&as->mutex);   
     switch (fe_cmd->cmd) {
     case XC_PCM_OPEN:
-	capture_is_running = 0;
+	as->running = 0;
 	break;
     case XC_PCM_CLOSE:
-	capture_is_running = 0;
+	as->running = 0;
 	break;
     case XC_PCM_PREPARE:
-	capture_is_running = 0;
+	as->running = 0;
 	as->hw_ptr = as->processed = as->processed_periods = 0;
 	break;
     case XC_TRIGGER_START:
 	refresh_be_info(as, 0, 0, 0, STREAM_STARTING);
-	generate_period_interrupt();
-	capture_is_running = 1;
+	alsa_notify(as);
+	as->running = 1;
+	as->dry = 0;
 	break;
     case XC_TRIGGER_STOP:
 	refresh_be_info(as, 0, 0, 0, STREAM_STOPPED);
-	generate_period_interrupt();
-	capture_is_running = 0;
+	alsa_notify(as);
+	as->running = 0;
+	break;
+    case XC_SET_VOLUME:
+    case XC_SET_MUTE:
+	process_mixer_cmd(fe_cmd, as);
 	break;
+    case XC_SET_DSP:
+	as->dsp = !!fe_cmd->data[0];
+	break;
+    }
+}
+
+/* Consumer half of the command queue: on the worker, or on the event loop
+ * with the worker shut out by host.lock. */
+static void alsa_drain_cmds(void)
+{
+    unsigned int cons = host.cmd_cons;
+    unsigned int prod = __atomic_load_n(&host.cmd_prod, __ATOMIC_ACQUIRE);
+    struct alsa_cmd *c;
+
+    while (cons != prod) {
+	c = &host.cmds[cons % ALSA_CMD_QUEUE];
+	alsa_apply_cmd(&c->cmd, c->as);
+	cons++;
     }
-    pthread_mutex_unlock(&as->mutex);   
+    __atomic_store_n(&host.cmd_cons, cons, __ATOMIC_RELEASE);
 }
 
+/*
+ * Producer half, on the event loop: the command takes effect at the start
+ * of the worker's next period, or as soon as the kick wakes it.
+ */
+static void alsa_queue_cmd(struct fe_cmd *fe_cmd, struct alsa_stream *as)
+{
+    unsigned int prod = host.cmd_prod;
+    unsigned int cons = __atomic_load_n(&host.cmd_cons, __ATOMIC_ACQUIRE);
+    struct alsa_cmd *c;
+
+    if (host.kick_fd < 0)
+	return;
+    if (prod - cons >= ALSA_CMD_QUEUE) {
+	printf("%s: queue full, dropping command %d\n", __FUNCTION__,
+	       fe_cmd->cmd);
+	return;
+    }
+    c = &host.cmds[prod % ALSA_CMD_QUEUE];
+    c->as = as;
+    c->cmd = *fe_cmd;
+    __atomic_store_n(&host.cmd_prod, prod + 1, __ATOMIC_RELEASE);
+    host_kick(host.kick_fd);
+}
+
+void process_playback_cmd(struct fe_cmd *fe_cmd, struct alsa_stream *as)
+{
+    alsa_queue_cmd(fe_cmd, as);
+}
+
+void process_capture_cmd(struct fe_cmd *fe_cmd, struct alsa_stream *as)
+{
+    alsa_queue_cmd(fe_cmd, as);
+}
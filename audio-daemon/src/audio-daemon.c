@@ -43,13 +43,12 @@
 #include <pthread.h>
 
 #include "ring.h"
-#include "mb.h"
+#include "sg.h"
+#include "resample.h"
 #include "audio-daemon.h"
 
 struct xc_interface *xc_handle = NULL;
-struct xen_vsnd_backend *glob_xvb;
 char paulian_debug[4];
-struct ring_t *cmd_ring = 0;
 
 struct xen_vsnd_device
 {
@@ -69,30 +68,32 @@ uint64_t get_nsec_now(void)
 
 void generate_period_interrupt(struct alsa_stream *as)
 {
-    backend_evtchn_notify(glob_xvb->back, glob_xvb->devid);
+    backend_evtchn_notify(as->xvb->back, as->xvb->devid);
 }
 
-void *playback_worker_thread(void *arg);
-void *capture_worker_thread(void *arg);
+/* Event loop side; the worker only counts. */
+void publish_xruns(struct xen_vsnd_backend *xvb)
+{
+    backend_print(xvb->back, xvb->devid, "playback-xruns", "%u",
+		  __atomic_load_n(&xvb->playback_xruns, __ATOMIC_RELAXED));
+    backend_print(xvb->back, xvb->devid, "capture-xruns", "%u",
+		  __atomic_load_n(&xvb->capture_xruns, __ATOMIC_RELAXED));
+    backend_print(xvb->back, xvb->devid, "playback-starved", "%u",
+		  __atomic_load_n(&xvb->starved, __ATOMIC_RELAXED));
+}
 
 static xen_device_t xen_vsnd_alloc(xen_backend_t backend, int devid, void *priv)
 {
     struct xen_vsnd_device *dev = priv;
     struct xen_vsnd_backend *xvb;
-    int err;
 
-    xvb = (struct xen_vsnd_backend*) malloc(sizeof (*xvb));
+    xvb = (struct xen_vsnd_backend*) calloc(1, sizeof (*xvb));
+    if (!xvb)
+	return NULL;
     xvb->devid = devid;
     xvb->dev = dev;
     xvb->back = backend;
 
-    glob_xvb = xvb;
-
-    err = pthread_mutex_init(&xvb->p.mutex, NULL);
-    err = pthread_mutex_init(&xvb->c.mutex, NULL);
-
-    init_speex();
-
     return xvb;
 }
 
@@ -100,11 +101,33 @@ static int xen_vsnd_init(xen_device_t xendev)
 {
     struct xen_vsnd_backend *xvb = xendev;
 
-    backend_print(xvb->back, xvb->devid, "sample-rate", "%d", SAMPLE_RATE);
+    backend_print(xvb->back, xvb->devid, "sample-rate", "%d", pcm_config.rate);
+    backend_print(xvb->back, xvb->devid, "period-frames-min", "%d", PERIOD_FRAMES_MIN);
+    backend_print(xvb->back, xvb->devid, "period-frames-max", "%d", PERIOD_FRAMES_MAX);
+    backend_print(xvb->back, xvb->devid, "buffer-frames-max", "%d", RING_FRAMES);
 
     return 0;
 }
 
+/* The frontend's wishes, applied when it next connects. */
+static void xen_vsnd_frontend_changed(xen_device_t xendev, const char *node,
+				      const char *val)
+{
+    struct xen_vsnd_backend *xvb = xendev;
+    const char *key = strrchr(node, '/');
+
+    key = key ? key + 1 : node;
+    if (!val)
+	return;
+
+    if (!strcmp(key, "sample-rate"))
+	xvb->fe_rate = atoi(val);
+    else if (!strcmp(key, "period-frames"))
+	xvb->fe_period_frames = atoi(val);
+    else if (!strcmp(key, "buffer-frames"))
+	xvb->fe_buffer_frames = atoi(val);
+}
+
 static void xen_vsnd_evtchn_handler(int xvb, short event, void *priv)
 {
     backend_evtchn_handler(priv);
@@ -118,15 +141,6 @@ static int xen_vsnd_connect(xen_device_t xendev)
 
     printf("%s\n", __FUNCTION__); fflush(stdout);
 
-    fd = backend_bind_evtchn(xvb->back, xvb->devid);
-    if (fd < 0)
-        return -1;
-
-    event_set(&xvb->evtchn_event, fd, EV_READ | EV_PERSIST,
-              xen_vsnd_evtchn_handler,
-              backend_evtchn_priv(xvb->back, xvb->devid));
-    event_add(&xvb->evtchn_event, NULL);
-
     page_ref = xvb->page = backend_map_shared_page(xvb->back, xvb->devid);
     if (!page_ref)
         return -1;
@@ -145,19 +159,37 @@ static int xen_vsnd_connect(xen_device_t xendev)
     }
     
 	/* cmd_ring */
-    if (!cmd_ring) {
-        printf("MAPPING CMDS RING!\n");
-    	cmd_ring = (struct ring_t *) xc_map_foreign_range(xc_handle, xvb->dev->domid,
-							  XENVSND_PAGE_SIZE, PROT_READ | PROT_WRITE,
-							  page_ref[300]);
-	ring_init(cmd_ring);
-    }
+    xvb->cmd_ring = (struct ring_t *) xc_map_foreign_range(xc_handle, xvb->dev->domid,
+							   XENVSND_PAGE_SIZE, PROT_READ | PROT_WRITE,
+							   page_ref[300]);
+    if (!xvb->cmd_ring)
+	return -1;
+    ring_init(xvb->cmd_ring);
 
     xvb->p.be_info = (struct be_info *) &page_ref[400];
 	
     xvb->c.be_info = (struct be_info *) &page_ref[500];
 
-    init_alsa(xvb);
+    if (init_alsa(xvb))
+	return -1;
+
+    /*
+     * Only now that the host is open: commands the guest kicks in before
+     * that would be queued for a worker that is not there.
+     */
+    fd = backend_bind_evtchn(xvb->back, xvb->devid);
+    if (fd < 0)
+        return -1;
+
+    event_set(&xvb->evtchn_event, fd, EV_READ | EV_PERSIST,
+              xen_vsnd_evtchn_handler,
+              backend_evtchn_priv(xvb->back, xvb->devid));
+    event_add(&xvb->evtchn_event, NULL);
+    xvb->evtchn_bound = 1;
+
+    backend_print(xvb->back, xvb->devid, "period-frames", "%d", xvb->p.period_frames);
+    backend_print(xvb->back, xvb->devid, "buffer-frames", "%d", xvb->p.buffer_frames);
+    publish_xruns(xvb);
 
     printf("%s exit\n", __FUNCTION__); fflush(stdout);
     return 0;
@@ -175,9 +207,11 @@ static void xen_vsnd_disconnect(xen_device_t xendev)
 
     cleanup_alsa(xvb);
 
-    event_del(&xvb->evtchn_event);
-
-    backend_unbind_evtchn(xvb->back, xvb->devid);
+    if (xvb->evtchn_bound) {
+	event_del(&xvb->evtchn_event);
+	backend_unbind_evtchn(xvb->back, xvb->devid);
+	xvb->evtchn_bound = 0;
+    }
 
     if (xvb->page) {
 	backend_unmap_shared_page(xvb->back, xvb->devid, xvb->page);
@@ -194,25 +228,33 @@ static void xen_vsnd_disconnect(xen_device_t xendev)
 	xvb->c.dma_buffer[i] = NULL;
     }
 
-    munmap(cmd_ring, XENVSND_PAGE_SIZE);
-    cmd_ring = NULL;
+    if (xvb->cmd_ring) {
+	munmap(xvb->cmd_ring, XENVSND_PAGE_SIZE);
+	xvb->cmd_ring = NULL;
+    }
 
     printf("%s exit\n", __FUNCTION__); fflush(stdout);
 }
 
 
+#define CMD_BATCH 16
+
 static void xen_vsnd_event(xen_device_t xendev)
 {
     struct xen_vsnd_backend *xvb = xendev;
-    struct fe_cmd cmd;
-    int len;
+    struct fe_cmd cmds[CMD_BATCH];
+    int i, n;
+
+    if (!xvb->cmd_ring)
+	return;
 
-    while (1) {
-	len = ring_read(cmd_ring, (void *)&cmd, sizeof(cmd));
-	if (len == sizeof(cmd)) {
+    /* Drain every complete command the frontend has posted so far. */
+    while ((n = ring_read_batch(xvb->cmd_ring, cmds, sizeof(cmds[0]), CMD_BATCH)) > 0) {
+	for (i = 0; i < n; i++) {
+	    struct fe_cmd *cmd = &cmds[i];
 
-	    printf("(%d) ", cmd.stream);
-	    switch(cmd.cmd) {
+	    printf("[%d] (%d) ", xvb->dev->domid, cmd->stream);
+	    switch(cmd->cmd) {
 	    case XC_PCM_OPEN:
 	    	printf("OPEN\n");
 	    	break;
@@ -228,16 +270,27 @@ static void xen_vsnd_event(xen_device_t xendev)
 	    case XC_TRIGGER_STOP:
 	    	printf("    STOP\n");
 	    	break;
+	    case XC_SET_VOLUME:
+	    	printf("VOLUME %d/%d\n", cmd->data[0], cmd->data[1]);
+	    	break;
+	    case XC_SET_MUTE:
+	    	printf("MUTE %d/%d\n", cmd->data[0], cmd->data[1]);
+	    	break;
+	    case XC_SET_DSP:
+	    	printf("DSP %d\n", cmd->data[0]);
+	    	break;
 	    }
 
-	    if (cmd.stream == XC_STREAM_PLAYBACK)
-		process_playback_cmd(&cmd, &xvb->p);
+	    if (cmd->stream == XC_STREAM_PLAYBACK)
+		process_playback_cmd(cmd, &xvb->p);
 	    else
-		process_capture_cmd(&cmd, &xvb->c);	
-	} else {
-	    return;
+		process_capture_cmd(cmd, &xvb->c);
 	}
     }
+
+    if (n < 0)
+	printf("%s: bad command ring indexes, pending commands dropped\n",
+	       __FUNCTION__);
 }
 
 static void xen_vsnd_free(xen_device_t xendev)
@@ -256,7 +309,7 @@ static struct xen_backend_ops xen_vsnd_backend_ops = {
     xen_vsnd_connect,
     xen_vsnd_disconnect,
     NULL,
-    NULL,
+    xen_vsnd_frontend_changed,
     xen_vsnd_event,
     xen_vsnd_free
 };
@@ -301,9 +354,76 @@ void xen_backend_init(int dom0)
     event_add(&backend_xenstore_event, NULL);
 }
 
+static void usage(const char *name)
+{
+    printf("usage: %s [options] domid [domid...]\n"
+	   "  -r rate   guest sample rate (%d)\n"
+	   "  -H rate   device sample rate, converted to in the daemon\n"
+	   "            (default: the guest rate, or what the device offers)\n"
+	   "  -p frames period for frontends that don't ask (%d)\n"
+	   "  -b frames buffer for frontends that don't ask (%d)\n"
+	   "  -E        no echo cancellation\n"
+	   "  -A        no automatic gain control\n"
+	   "  -D        no denoise\n"
+	   "  -f frames speex frame size, divides the period (whole period)\n"
+	   "  -t frames echo canceller tail (%d)\n"
+	   "  -s n      print capture pipeline timings every n periods\n",
+	   name, pcm_config.rate, pcm_config.period_frames,
+	   pcm_config.buffer_frames, dsp_config.tail);
+}
+
 int main(int argc, char *argv[])
 {
-    int companion = atoi(argv[1]);
+    int i, c;
+
+    while ((c = getopt(argc, argv, "r:H:p:b:EADf:t:s:h")) != -1) {
+	switch (c) {
+	case 'r':
+	    pcm_config.rate = atoi(optarg);
+	    break;
+	case 'H':
+	    pcm_config.hw_rate = atoi(optarg);
+	    break;
+	case 'p':
+	    pcm_config.period_frames = atoi(optarg);
+	    break;
+	case 'b':
+	    pcm_config.buffer_frames = atoi(optarg);
+	    break;
+	case 'E':
+	    dsp_config.aec = 0;
+	    break;
+	case 'A':
+	    dsp_config.agc = 0;
+	    break;
+	case 'D':
+	    dsp_config.denoise = 0;
+	    break;
+	case 'f':
+	    dsp_config.frame_size = atoi(optarg);
+	    break;
+	case 't':
+	    dsp_config.tail = atoi(optarg);
+	    break;
+	case 's':
+	    dsp_config.stats = atoi(optarg);
+	    break;
+	default:
+	    usage(argv[0]);
+	    return 1;
+	}
+    }
+
+    if (optind >= argc || pcm_config.rate <= 0 || pcm_config.hw_rate < 0 ||
+	pcm_config.period_frames < PERIOD_FRAMES_MIN ||
+	pcm_config.period_frames > PERIOD_FRAMES_MAX) {
+	usage(argv[0]);
+	return 1;
+    }
+
+    /* Before the worker threads that use them exist. */
+    sg_use_kernel(SG_KERNEL_AUTO);
+    resample_use_kernel(SG_KERNEL_AUTO);
 
     event_init ();
 
@@ -312,9 +432,14 @@ int main(int argc, char *argv[])
         return -1;
 
     xen_backend_init (0);
-        
-    printf("companion domain = %d\n", companion);
-    xen_vsnd_device_create(companion); 
+
+    /* One vsnd backend per guest, all mixed into the same host device. */
+    for (i = optind; i < argc; i++) {
+	int companion = atoi(argv[i]);
+
+	printf("companion domain = %d\n", companion);
+	xen_vsnd_device_create(companion); 
+    }
 
     event_dispatch();
 	
@@ -27,8 +27,20 @@ enum xc_cmd {
     XC_PCM_PREPARE,
     XC_TRIGGER_START,
     XC_TRIGGER_STOP,
+    XC_SET_VOLUME,
+    XC_SET_MUTE,
+    XC_SET_DSP,
 };
 
+/*
+ * fe_cmd data for the mixer commands, per stream:
+ *   XC_SET_VOLUME: data[0] left, data[1] right, in percent (0-100)
+ *   XC_SET_MUTE:   data[0] left, data[1] right, non-zero mutes
+ *   XC_SET_DSP:    data[0] non-zero for echo cancelled, preprocessed
+ *                  capture (the default), zero for the raw input
+ */
+#define XC_VOLUME_MAX 100
+
 enum stream_status {
     STREAM_STOPPED = 0,
     STREAM_STARTING,
@@ -43,6 +55,16 @@ struct fe_cmd {
     uint64_t s_time;
 } __attribute__((packed));
 
+/*
+ * Written by the backend each period the guest is interrupted for.
+ * s_time is the guest time (xc_hvm_get_time) hw_ptr was at, filtered
+ * against the sound card's clock so it doesn't carry the daemon's
+ * wakeup jitter; delay is how many frames hw_ptr was from the converter
+ * then, still to be played or captured but not yet delivered. rate_mhz
+ * is the stream's rate as measured against the card, in thousandths of
+ * a Hz, 0 until the stream has started. The fields are consistent when
+ * seq is even and the same before and after reading them.
+ */
 struct be_info {
     int hw_ptr;
     int delay;
@@ -50,39 +72,87 @@ struct be_info {
     uint64_t s_time;
     uint64_t appl_ptr;
     enum stream_status status;
+    uint32_t rate_mhz;
+    uint32_t seq;
 };
 
 #define N_AUD_BUFFER_PAGES 8
 #define XENVSND_PAGE_SIZE 4096
-#define P_PERIOD_FRAMES 1024
-#define P_BUFFER_FRAMES 4096
-#define C_PERIOD_FRAMES P_PERIOD_FRAMES
-#define C_BUFFER_FRAMES P_BUFFER_FRAMES
-#define PERIOD_FRAMES P_PERIOD_FRAMES
-#define BUFFER_FRAMES P_BUFFER_FRAMES
+#define FRAME_BYTES 4 /* S16 stereo */
+#define RING_FRAMES (N_AUD_BUFFER_PAGES * XENVSND_PAGE_SIZE / FRAME_BYTES)
+
+/*
+ * Each frontend may ask for its own period and buffer size by writing
+ * period-frames and buffer-frames under its xenstore node; the values
+ * in use are written back under the backend node when it connects.
+ * Frontends that don't ask get the defaults: 1024 frame periods over
+ * the whole DMA ring. The host device runs at the smallest period of
+ * the guests attached, with HOST_BUFFER_PERIODS periods of buffer.
+ */
+#define PERIOD_FRAMES_MIN 64
+#define PERIOD_FRAMES_MAX (RING_FRAMES / 2)
+#define PERIOD_FRAMES 1024
+#define BUFFER_FRAMES RING_FRAMES
+#define HOST_BUFFER_PERIODS 4
 #define SAMPLE_RATE            (44100)
-#define PERIOD_BYTES            (PERIOD_FRAMES * 4)
 
+/* The host ALSA PCM, one per direction, shared by every guest. */
+struct alsa_device {
+    uint8_t stream_type;
+    unsigned int rate;  /* asked for, or on offer if refused */
+    snd_pcm_t *handle;
+    snd_pcm_hw_params_t *hwparams;
+    snd_pcm_sw_params_t *swparams;
+    int suspended;      /* resume refused for now, retried by the worker */
+};
+
+/* A guest stream, fed from or mixed into the host alsa_device. */
 struct alsa_stream {
     uint8_t stream_type;
+    struct xen_vsnd_backend *xvb;
     void *dma_buffer[N_AUD_BUFFER_PAGES];
     struct be_info *be_info;
+    int period_frames;  /* negotiated, the interrupt rate */
+    int buffer_frames;  /* negotiated, hw_ptr wraps here */
     int hw_ptr;
     int app_ptr;
-    snd_pcm_t *handle;
-    snd_pcm_hw_params_t *hwparams;
-    snd_pcm_sw_params_t *swparams;
-    snd_async_handler_t *ahandler;
+    int running;
     int vol_l;
     int vol_r;
+    int mute_l;
+    int mute_r;
+    int gain_l; /* applied by the sg copies, SG_GAIN_* fixed point */
+    int gain_r;
+    int dsp; /* capture through the host pipeline */
+    int dry; /* playback ran out, counted in starved */
     enum stream_status status;
-    pthread_mutex_t mutex;
     int32_t processed;
     int32_t processed_periods;
     uint64_t last_time;
-    pthread_t worker_thread;
 };
 
+/* Host device defaults, set from the command line before any guest. */
+struct pcm_config {
+    int rate;           /* the guests' */
+    int hw_rate;        /* the devices', 0 for the same as rate */
+    int period_frames;  /* for frontends that don't ask */
+    int buffer_frames;
+};
+
+extern struct pcm_config pcm_config;
+
+/* Host capture pipeline, set from the command line before any guest. */
+struct dsp_config {
+    int aec;
+    int agc;
+    int denoise;
+    int frame_size;     /* frames per speex call, 0 for the whole period */
+    int tail;           /* echo canceller tail, in frames */
+    int stats;          /* print stage timings every so many periods */
+};
+
+extern struct dsp_config dsp_config;
+
 struct xen_vsnd_backend {
     struct xen_vsnd_device *dev;
     xen_backend_t back;
@@ -90,10 +160,37 @@ struct xen_vsnd_backend {
 
     void *page;
     struct event evtchn_event;
+    int evtchn_bound;
+    struct ring_t *cmd_ring;
 
     struct alsa_stream p;
     struct alsa_stream c;
+
+    /* Attached to the host mixer, under its lock. */
+    struct xen_vsnd_backend *next;
+    int period_pending; /* set by the audio worker, atomic */
+
+    /* Asked for by the frontend, 0 for the defaults. */
+    int fe_rate;
+    int fe_period_frames;
+    int fe_buffer_frames;
+
+    /*
+     * Counted by the audio worker, written to xenstore by the event loop
+     * when xrun_gen moves: xruns of the host devices while this guest
+     * streamed through them, and gaps in its own playback.
+     */
+    unsigned int playback_xruns;
+    unsigned int capture_xruns;
+    unsigned int starved;
+    unsigned int xrun_gen;      /* atomic */
+    unsigned int xrun_published;
 };
 
 struct event audio_work_timer;
 void audio_work(int a, short b, void *arg);
+
+/* Guest time, in ns; 64 bits, so it can't go through an implicit int. */
+uint64_t get_nsec_now(void);
+
+void publish_xruns(struct xen_vsnd_backend *xvb);
@@ -0,0 +1,92 @@
+/*
+ * dll.c:
+ *
+ *
+ */
+
+/*
+ * Copyright (c) 2012 Citrix Systems, Inc.
+ * 
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <stdint.h>
+#include <math.h>
+
+#include "dll.h"
+
+void dll_init(struct dll *dll, int rate)
+{
+    dll->nominal = 1e9 / rate;
+    dll_reset(dll);
+}
+
+void dll_reset(struct dll *dll)
+{
+    dll->period = dll->nominal;
+    dll->locked = 0;
+}
+
+/*
+ * Critically damped: with w = 2 pi B T for an update interval T, the
+ * time is corrected by sqrt(2) w of the error and the frame length by
+ * w^2 of it, spread over the frames the interval covered.
+ */
+int dll_update(struct dll *dll, uint64_t pos, int64_t t)
+{
+    double frames, interval, err, w;
+
+    frames = (double)(int64_t)(pos - dll->p0);
+    interval = frames * dll->period;
+    if (dll->locked && frames > 0) {
+	err = (double)(t - dll->base) - (dll->t0 + interval);
+	if (fabs(err) < interval) {
+	    if (dll->t0 < DLL_SETTLE_NS) {
+		w = 2 * M_PI * interval * 1e-9 * DLL_BW_START;
+	    } else {
+		w = 2 * M_PI * interval * 1e-9 * DLL_BW;
+		if (err > DLL_CLIP_NS)
+		    err = DLL_CLIP_NS;
+		else if (err < -DLL_CLIP_NS)
+		    err = -DLL_CLIP_NS;
+	    }
+	    dll->t0 += interval + M_SQRT2 * w * err;
+	    dll->period += w * w * err / frames;
+	    dll->p0 = pos;
+	    return 0;
+	}
+    }
+
+    /* Start again from this measurement, keeping the rate if known. */
+    if (!dll->locked || frames <= 0)
+	dll->period = dll->nominal;
+    dll->base = t;
+    dll->t0 = 0;
+    dll->p0 = pos;
+    dll->locked = 1;
+    return 1;
+}
+
+int64_t dll_time(const struct dll *dll, uint64_t pos)
+{
+    return dll->base + (int64_t)llrint(dll->t0 +
+				       ((double)pos - (double)dll->p0) *
+				       dll->period);
+}
+
+double dll_ratio(const struct dll *dll)
+{
+    return dll->nominal / dll->period;
+}
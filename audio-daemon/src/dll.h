@@ -0,0 +1,64 @@
+/*
+ * Copyright (c) 2012 Citrix Systems, Inc.
+ * 
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef _DLL_H_
+#define _DLL_H_
+
+#include <stdint.h>
+
+/*
+ * Second order delay locked loop tracking a sound card clock: fed the
+ * frame position of the device and the time it was measured at, it keeps
+ * a filtered time for that position and the measured length of a frame,
+ * so timestamp jitter is smoothed out while the drift of the card's
+ * clock against the system's is followed.
+ *
+ * The loop starts wide, DLL_BW_START, to lock on quickly and narrows to
+ * DLL_BW after DLL_SETTLE_NS. From then on errors are clipped to
+ * DLL_CLIP_NS, so a stalled wakeup moves the estimate no more than an
+ * ordinary late one. An error larger than the time since the last
+ * update, as after an xrun or a clock step, restarts it.
+ */
+
+#define DLL_BW_START 1.0        /* Hz */
+#define DLL_BW 0.1
+#define DLL_SETTLE_NS 2000000000LL
+#define DLL_CLIP_NS 1000000.0
+
+struct dll {
+    double nominal;     /* ns per frame, at the nominal rate */
+    double period;      /* ns per frame, measured */
+    int64_t base;       /* times below are relative to this, in ns */
+    double t0;          /* filtered time of frame p0 */
+    uint64_t p0;
+    int locked;         /* seen at least one update */
+};
+
+void dll_init(struct dll *dll, int rate);
+void dll_reset(struct dll *dll);
+
+/* Returns non-zero if the loop (re)started on this update. */
+int dll_update(struct dll *dll, uint64_t pos, int64_t t);
+
+/* Filtered time of frame pos, in the clock dll_update() was fed. */
+int64_t dll_time(const struct dll *dll, uint64_t pos);
+
+/* Measured rate over nominal rate. */
+double dll_ratio(const struct dll *dll);
+
+#endif
@@ -0,0 +1,134 @@
+/*
+ * dll_bench.c:
+ *
+ *
+ */
+
+/*
+ * Copyright (c) 2012 Citrix Systems, Inc.
+ * 
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * Clock filter benchmark, no Xen or ALSA needed.
+ *
+ * Simulates a sound card running some ppm off 44100Hz, with 1024 frame
+ * periods timestamped late by a random scheduling delay and now and then
+ * by a long stall. Compares the raw timestamps, which is what the guests
+ * used to get, and the delay locked loop's filtered ones against the true
+ * period boundaries, once the loop has settled, and reports how well it
+ * tracks the rate and what an update costs.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <math.h>
+#include <time.h>
+
+#include "dll.h"
+
+#define RATE 44100
+#define PERIOD 1024
+#define SECONDS 600
+#define SKIP_NS 10000000000LL   /* let the loop settle */
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Up to 500us late, and 1 in 50 periods 3ms more. */
+static int64_t jitter(void)
+{
+    int64_t j = rand() % 500000;
+
+    if (rand() % 50 == 0)
+	j += 3000000;
+    return j;
+}
+
+struct err {
+    double sum, sum2, min, max;
+    int n;
+};
+
+static void account(struct err *e, double err)
+{
+    if (!e->n || err < e->min)
+	e->min = err;
+    if (!e->n || err > e->max)
+	e->max = err;
+    e->sum += err;
+    e->sum2 += err * err;
+    e->n++;
+}
+
+/* The mean is a fixed latency; what the guests have to pad for is the
+ * spread around it. */
+static void print(const char *name, struct err *e, double scale,
+		  const char *unit)
+{
+    double mean = e->sum / e->n;
+
+    printf("  %-16s mean %7.1f %s  sd %7.1f %s  range %7.1f %s\n", name,
+	   mean / scale, unit, sqrt(e->sum2 / e->n - mean * mean) / scale,
+	   unit, (e->max - e->min) / scale, unit);
+}
+
+static void run(double ppm)
+{
+    double true_rate = RATE * (1 + ppm * 1e-6);
+    struct err raw = { 0 }, filtered = { 0 }, rate = { 0 };
+    struct dll dll;
+    double t0;
+    uint64_t pos;
+    int64_t t, truth;
+    int i, n = SECONDS * RATE / PERIOD, restarts = 0;
+
+    srand(1);
+    dll_init(&dll, RATE);
+    t0 = now();
+    for (i = 1; i <= n; i++) {
+	pos = (uint64_t)i * PERIOD;
+	truth = (int64_t)llrint(pos * 1e9 / true_rate) + 1000000000LL;
+	t = truth + jitter();
+	restarts += dll_update(&dll, pos, t);
+	if (truth - 1000000000LL < SKIP_NS)
+	    continue;
+	account(&raw, t - truth);
+	account(&filtered, dll_time(&dll, pos) - truth);
+	account(&rate, (dll_ratio(&dll) - 1) * 1e6 - ppm);
+    }
+    t0 = now() - t0;
+
+    printf("card at %+.0f ppm, %d periods of %d frames\n", ppm, n, PERIOD);
+    print("raw timestamps", &raw, 1e3, "us");
+    print("filtered", &filtered, 1e3, "us");
+    print("rate error", &rate, 1, "ppm");
+    printf("  %d restarts, %.0f ns/update\n", restarts - 1, t0 / n * 1e9);
+}
+
+int main(void)
+{
+    run(0);
+    run(80);
+    run(-250);
+    return 0;
+}
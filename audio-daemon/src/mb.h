@@ -19,16 +19,13 @@
 #ifndef _MB_H_
 #define _MB_H_
 
-#if defined(__i386__)
-#define mb()  asm volatile ( "lock; addl $0,0(%%esp)" : : : "memory" )
-#define rmb() asm volatile ( "lock; addl $0,0(%%esp)" : : : "memory" )
-#define wmb() asm volatile ( "" : : : "memory")
-#elif defined(__x86_64__)
-#define mb()  asm volatile ( "mfence" : : : "memory")
-#define rmb() asm volatile ( "lfence" : : : "memory")
-#define wmb() asm volatile ( "" : : : "memory")
-#else
-#error "Unknow architecture"
-#endif
+/*
+ * Fences on the C11 memory model, so this builds on any architecture the
+ * compiler knows. On x86 rmb()/wmb() are compiler barriers and mb() is a
+ * full fence, as before.
+ */
+#define mb()  __atomic_thread_fence(__ATOMIC_SEQ_CST)
+#define rmb() __atomic_thread_fence(__ATOMIC_ACQUIRE)
+#define wmb() __atomic_thread_fence(__ATOMIC_RELEASE)
 
 #endif
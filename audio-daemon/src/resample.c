@@ -0,0 +1,352 @@
+/*
+ * resample.c:
+ *
+ *
+ */
+
+/*
+ * Copyright (c) 2012 Citrix Systems, Inc.
+ * 
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#if defined(__i386__) || defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+#include "resample.h"
+
+#define KAISER_BETA 8.0
+#define PASSBAND 0.91   /* of the lower Nyquist frequency */
+
+struct resampler;
+typedef int (*block_fn)(struct resampler *rs, int16_t *out);
+
+struct resampler {
+    int up, down;
+    int step, step_frac; /* down / up, down % up: input advance per output */
+    int16_t *coeffs;    /* up phases of RESAMPLE_TAPS */
+    int max_in;
+
+    /* Planar history: RESAMPLE_TAPS - 1 frames, then the current block. */
+    int16_t *hist[RESAMPLE_CHANNELS];
+    int fill;           /* frames in hist */
+    int idx;            /* first input frame of the next output */
+    int phase;          /* its fractional position, in 1/up */
+};
+
+static inline int16_t q15(int32_t v)
+{
+    v = (v + (1 << 14)) >> 15;
+    return v > INT16_MAX ? INT16_MAX : v < INT16_MIN ? INT16_MIN : v;
+}
+
+/*
+ * Every output the history allows, for one kernel. Inlined into each
+ * kernel's own block function so the dot product inlines too.
+ */
+static inline __attribute__((always_inline))
+int block(struct resampler *rs, int16_t *out,
+          int32_t (*dot)(const int16_t *a, const int16_t *b))
+{
+    const int16_t *l = rs->hist[0], *r = rs->hist[1];
+    int n = 0;
+
+    while (rs->idx + RESAMPLE_TAPS <= rs->fill) {
+	const int16_t *c = rs->coeffs + rs->phase * RESAMPLE_TAPS;
+
+	out[2 * n] = q15(dot(l + rs->idx, c));
+	out[2 * n + 1] = q15(dot(r + rs->idx, c));
+	n++;
+
+	rs->idx += rs->step;
+	rs->phase += rs->step_frac;
+	if (rs->phase >= rs->up) {
+	    rs->phase -= rs->up;
+	    rs->idx++;
+	}
+    }
+    return n;
+}
+
+static inline __attribute__((always_inline))
+int32_t dot_scalar(const int16_t *a, const int16_t *b)
+{
+    int32_t sum = 0;
+    int i;
+
+    for (i = 0; i < RESAMPLE_TAPS; i++)
+	sum += (int32_t)a[i] * b[i];
+    return sum;
+}
+
+static int block_scalar(struct resampler *rs, int16_t *out)
+{
+    return block(rs, out, dot_scalar);
+}
+
+#if defined(__SSE2__)
+static inline __attribute__((always_inline))
+int32_t dot_sse2(const int16_t *a, const int16_t *b)
+{
+    __m128i sum = _mm_setzero_si128();
+    int i;
+
+    for (i = 0; i < RESAMPLE_TAPS; i += 8) {
+	__m128i x = _mm_loadu_si128((const __m128i *)(a + i));
+	__m128i y = _mm_loadu_si128((const __m128i *)(b + i));
+
+	sum = _mm_add_epi32(sum, _mm_madd_epi16(x, y));
+    }
+    sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, _MM_SHUFFLE(1, 0, 3, 2)));
+    sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, _MM_SHUFFLE(2, 3, 0, 1)));
+    return _mm_cvtsi128_si32(sum);
+}
+
+static int block_sse2(struct resampler *rs, int16_t *out)
+{
+    return block(rs, out, dot_sse2);
+}
+#endif
+
+#if defined(__i386__) || defined(__x86_64__)
+static inline __attribute__((always_inline, target("avx2")))
+int32_t dot_avx2(const int16_t *a, const int16_t *b)
+{
+    __m256i sum = _mm256_setzero_si256();
+    __m128i s;
+    int i;
+
+    for (i = 0; i < RESAMPLE_TAPS; i += 16) {
+	__m256i x = _mm256_loadu_si256((const __m256i *)(a + i));
+	__m256i y = _mm256_loadu_si256((const __m256i *)(b + i));
+
+	sum = _mm256_add_epi32(sum, _mm256_madd_epi16(x, y));
+    }
+    s = _mm_add_epi32(_mm256_castsi256_si128(sum),
+		      _mm256_extracti128_si256(sum, 1));
+    s = _mm_add_epi32(s, _mm_shuffle_epi32(s, _MM_SHUFFLE(1, 0, 3, 2)));
+    s = _mm_add_epi32(s, _mm_shuffle_epi32(s, _MM_SHUFFLE(2, 3, 0, 1)));
+    return _mm_cvtsi128_si32(s);
+}
+
+__attribute__((target("avx2")))
+static int block_avx2(struct resampler *rs, int16_t *out)
+{
+    return block(rs, out, dot_avx2);
+}
+#endif
+
+static block_fn resample_block;
+static const char *resample_block_name;
+
+int resample_use_kernel(enum sg_kernel kernel)
+{
+    if (kernel == SG_KERNEL_AUTO) {
+#if defined(__i386__) || defined(__x86_64__)
+	if (__builtin_cpu_supports("avx2"))
+	    return resample_use_kernel(SG_KERNEL_AVX2);
+#endif
+#if defined(__SSE2__)
+	return resample_use_kernel(SG_KERNEL_SSE2);
+#else
+	return resample_use_kernel(SG_KERNEL_SCALAR);
+#endif
+    }
+
+    switch (kernel) {
+    case SG_KERNEL_SCALAR:
+	resample_block = block_scalar;
+	resample_block_name = "scalar";
+	return 0;
+#if defined(__SSE2__)
+    case SG_KERNEL_SSE2:
+	resample_block = block_sse2;
+	resample_block_name = "sse2";
+	return 0;
+#endif
+#if defined(__i386__) || defined(__x86_64__)
+    case SG_KERNEL_AVX2:
+	if (!__builtin_cpu_supports("avx2"))
+	    return -1;
+	resample_block = block_avx2;
+	resample_block_name = "avx2";
+	return 0;
+#endif
+    default:
+	return -1;
+    }
+}
+
+const char *resample_kernel_name(void)
+{
+    return resample_block_name;
+}
+
+static int gcd(int a, int b)
+{
+    while (b) {
+	int t = a % b;
+
+	a = b;
+	b = t;
+    }
+    return a;
+}
+
+/* Zeroth order modified Bessel function, for the Kaiser window. */
+static double bessel_i0(double x)
+{
+    double sum = 1, term = 1;
+    int k;
+
+    for (k = 1; k < 50; k++) {
+	term *= (x / (2 * k)) * (x / (2 * k));
+	sum += term;
+	if (term < sum * 1e-12)
+	    break;
+    }
+    return sum;
+}
+
+/*
+ * Phase p of the output lies p/up of an input frame past the centre of
+ * its window, so tap j weighs the input at distance j - centre - p/up.
+ * Each phase is scaled to unity gain after rounding to Q15.
+ */
+static void design(struct resampler *rs)
+{
+    double fc = PASSBAND * (rs->up < rs->down ? (double)rs->up / rs->down : 1.0);
+    double half = RESAMPLE_TAPS / 2;
+    double h[RESAMPLE_TAPS];
+    int p, j;
+
+    for (p = 0; p < rs->up; p++) {
+	int16_t *c = rs->coeffs + p * RESAMPLE_TAPS;
+	double sum = 0, x, w;
+	int32_t isum = 0;
+
+	for (j = 0; j < RESAMPLE_TAPS; j++) {
+	    x = j - (half - 1) - (double)p / rs->up;
+	    w = x / half;
+	    w = fabs(w) >= 1 ? 0 : bessel_i0(KAISER_BETA * sqrt(1 - w * w)) /
+		bessel_i0(KAISER_BETA);
+	    h[j] = (x == 0 ? fc : sin(M_PI * fc * x) / (M_PI * x)) * w;
+	    sum += h[j];
+	}
+	for (j = 0; j < RESAMPLE_TAPS; j++) {
+	    c[j] = lrint(h[j] / sum * 32768);
+	    isum += c[j];
+	}
+	/* Put the rounding error on the centre tap. */
+	c[(int)half - 1] += 32768 - isum;
+    }
+}
+
+struct resampler *resampler_new(int in_rate, int out_rate, int max_in_frames)
+{
+    struct resampler *rs;
+    int g, i;
+
+    if (in_rate <= 0 || out_rate <= 0 || max_in_frames <= 0)
+	return NULL;
+
+    rs = calloc(1, sizeof(*rs));
+    if (!rs)
+	return NULL;
+
+    g = gcd(in_rate, out_rate);
+    rs->up = out_rate / g;
+    rs->down = in_rate / g;
+    rs->step = rs->down / rs->up;
+    rs->step_frac = rs->down % rs->up;
+    rs->max_in = max_in_frames;
+
+    rs->coeffs = malloc(rs->up * RESAMPLE_TAPS * sizeof(int16_t));
+    for (i = 0; i < RESAMPLE_CHANNELS; i++)
+	rs->hist[i] = malloc((RESAMPLE_TAPS + max_in_frames) * sizeof(int16_t));
+    if (!rs->coeffs || !rs->hist[0] || !rs->hist[1]) {
+	resampler_free(rs);
+	return NULL;
+    }
+
+    design(rs);
+    resampler_reset(rs);
+    return rs;
+}
+
+void resampler_free(struct resampler *rs)
+{
+    int i;
+
+    if (!rs)
+	return;
+    for (i = 0; i < RESAMPLE_CHANNELS; i++)
+	free(rs->hist[i]);
+    free(rs->coeffs);
+    free(rs);
+}
+
+/* Back to silence, as after a restart of the device. */
+void resampler_reset(struct resampler *rs)
+{
+    int i;
+
+    for (i = 0; i < RESAMPLE_CHANNELS; i++)
+	memset(rs->hist[i], 0, (RESAMPLE_TAPS - 1) * sizeof(int16_t));
+    rs->fill = RESAMPLE_TAPS - 1;
+    rs->idx = 0;
+    rs->phase = 0;
+}
+
+int resampler_max_out(struct resampler *rs, int in_frames)
+{
+    return (int)(((int64_t)in_frames * rs->up + rs->down - 1) / rs->down) + 1;
+}
+
+int resampler_process(struct resampler *rs, const int16_t *in, int in_frames,
+                      int16_t *out)
+{
+    int16_t *l = rs->hist[0], *r = rs->hist[1];
+    int i, n, keep;
+
+    if (in_frames > rs->max_in)
+	in_frames = rs->max_in;
+
+    /* Deinterleave behind the history. */
+    for (i = 0; i < in_frames; i++) {
+	l[rs->fill + i] = in[2 * i];
+	r[rs->fill + i] = in[2 * i + 1];
+    }
+    rs->fill += in_frames;
+
+    n = resample_block(rs, out);
+
+    /* Slide what the next outputs still need to the front. */
+    keep = rs->fill - rs->idx;
+    if (keep > 0) {
+	memmove(l, l + rs->idx, keep * sizeof(int16_t));
+	memmove(r, r + rs->idx, keep * sizeof(int16_t));
+    }
+    rs->fill = keep > 0 ? keep : 0;
+    rs->idx = keep < 0 ? -keep : 0;
+
+    return n;
+}
@@ -0,0 +1,53 @@
+/*
+ * Copyright (c) 2012 Citrix Systems, Inc.
+ * 
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef _RESAMPLE_H_
+#define _RESAMPLE_H_
+
+#include <stdint.h>
+
+#include "sg.h"
+
+/*
+ * Polyphase sample rate converter for interleaved S16 stereo, run on one
+ * period at a time. The ratio is reduced to up/down, and each output frame
+ * is a RESAMPLE_TAPS long dot product of one channel's history with one
+ * of the up phases of a Kaiser windowed sinc, in Q15.
+ */
+
+#define RESAMPLE_TAPS 32
+#define RESAMPLE_CHANNELS 2
+
+struct resampler;
+
+struct resampler *resampler_new(int in_rate, int out_rate, int max_in_frames);
+void resampler_free(struct resampler *rs);
+void resampler_reset(struct resampler *rs);
+
+/* Output frames in_frames of input can produce, at most. */
+int resampler_max_out(struct resampler *rs, int in_frames);
+
+/* Consumes all of in, returns the frames written to out. */
+int resampler_process(struct resampler *rs, const int16_t *in, int in_frames,
+                      int16_t *out);
+
+/* Same rules as sg_use_kernel(), before the first resampler_process(). */
+int resample_use_kernel(enum sg_kernel kernel);
+const char *resample_kernel_name(void);
+
+#endif
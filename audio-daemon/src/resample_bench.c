@@ -0,0 +1,217 @@
+/*
+ * resample_bench.c:
+ *
+ *
+ */
+
+/*
+ * Copyright (c) 2012 Citrix Systems, Inc.
+ * 
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * Resampler benchmark, no Xen or ALSA needed.
+ *
+ * Converts 1024 frame periods of a 1kHz stereo tone between 44100Hz and
+ * 48000Hz with each polyphase kernel and with linear interpolation, the
+ * converter ALSA's plug layer falls back to when no other rate plugin is
+ * configured. Reports the CPU time per period, the share of one core a
+ * stream takes, and the signal to noise ratio of the output against a
+ * least squares fit of the tone. The SIMD kernels must match the scalar
+ * one bit for bit.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+
+#include "resample.h"
+
+#define PERIOD 1024
+#define PERIODS 64
+#define TONE 1000.0
+
+static int16_t in[PERIODS * PERIOD * 2];
+static int16_t out[PERIODS * PERIOD * 2 * 2];
+static int16_t ref[PERIODS * PERIOD * 2 * 2];
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* What ALSA's rate_linear does: one interpolation between neighbours. */
+struct linear {
+    unsigned int pos;   /* 16.16, in input frames */
+    unsigned int step;
+    int16_t last[2];
+};
+
+static int linear_process(struct linear *lr, const int16_t *src, int frames,
+			  int16_t *dst)
+{
+    int n = 0;
+
+    while ((lr->pos >> 16) < (unsigned int)frames) {
+	unsigned int i = lr->pos >> 16, f = lr->pos & 0xffff;
+	const int16_t *a = i ? src + 2 * (i - 1) : lr->last;
+	const int16_t *b = src + 2 * i;
+
+	dst[2 * n] = a[0] + (((b[0] - a[0]) * (int)f) >> 16);
+	dst[2 * n + 1] = a[1] + (((b[1] - a[1]) * (int)f) >> 16);
+	n++;
+	lr->pos += lr->step;
+    }
+    lr->pos -= frames << 16;
+    lr->last[0] = src[2 * (frames - 1)];
+    lr->last[1] = src[2 * (frames - 1) + 1];
+    return n;
+}
+
+/* Fit a*sin + b*cos + c to the left channel, skipping the start up. */
+static double snr(const int16_t *x, int frames, double rate)
+{
+    double s[3][3] = { { 0 } }, v[3] = { 0 }, a, b, c, det, sig = 0, err = 0;
+    int i, skip = 256;
+
+    for (i = skip; i < frames; i++) {
+	double bs[3] = { sin(2 * M_PI * TONE * i / rate),
+			 cos(2 * M_PI * TONE * i / rate), 1 };
+	int j, k;
+
+	for (j = 0; j < 3; j++) {
+	    for (k = 0; k < 3; k++)
+		s[j][k] += bs[j] * bs[k];
+	    v[j] += bs[j] * x[2 * i];
+	}
+    }
+    /* Cramer's rule. */
+    det = s[0][0] * (s[1][1] * s[2][2] - s[1][2] * s[2][1]) -
+	s[0][1] * (s[1][0] * s[2][2] - s[1][2] * s[2][0]) +
+	s[0][2] * (s[1][0] * s[2][1] - s[1][1] * s[2][0]);
+    a = (v[0] * (s[1][1] * s[2][2] - s[1][2] * s[2][1]) -
+	 s[0][1] * (v[1] * s[2][2] - s[1][2] * v[2]) +
+	 s[0][2] * (v[1] * s[2][1] - s[1][1] * v[2])) / det;
+    b = (s[0][0] * (v[1] * s[2][2] - s[1][2] * v[2]) -
+	 v[0] * (s[1][0] * s[2][2] - s[1][2] * s[2][0]) +
+	 s[0][2] * (s[1][0] * v[2] - v[1] * s[2][0])) / det;
+    c = (s[0][0] * (s[1][1] * v[2] - v[1] * s[2][1]) -
+	 s[0][1] * (s[1][0] * v[2] - v[1] * s[2][0]) +
+	 v[0] * (s[1][0] * s[2][1] - s[1][1] * s[2][0])) / det;
+
+    for (i = skip; i < frames; i++) {
+	double y = a * sin(2 * M_PI * TONE * i / rate) +
+	    b * cos(2 * M_PI * TONE * i / rate) + c;
+
+	sig += y * y;
+	err += (x[2 * i] - y) * (x[2 * i] - y);
+    }
+    return 10 * log10(sig / err);
+}
+
+static void report(const char *name, double t, int periods, int in_rate,
+		   double db)
+{
+    double ns = t / periods * 1e9;
+    double period_ns = PERIOD * 1e9 / in_rate;
+
+    printf("  %-16s %8.0f ns/period %6.3f%% cpu/stream %6.1f dB\n",
+	   name, ns, 100 * ns / period_ns, db);
+}
+
+static int run(int in_rate, int out_rate, int loops)
+{
+    enum sg_kernel kernels[] = { SG_KERNEL_SCALAR, SG_KERNEL_SSE2,
+				 SG_KERNEL_AVX2 };
+    struct resampler *rs;
+    struct linear lr;
+    double t0, t;
+    int i, k, l, n = 0, ref_n = 0;
+
+    for (i = 0; i < PERIODS * PERIOD; i++)
+	in[2 * i] = in[2 * i + 1] =
+	    lrint(16000 * sin(2 * M_PI * TONE * i / in_rate));
+
+    printf("%d -> %d Hz, %d frame periods\n", in_rate, out_rate, PERIOD);
+
+    rs = resampler_new(in_rate, out_rate, PERIOD);
+    if (!rs)
+	return -1;
+
+    for (k = 0; k < (int)(sizeof(kernels) / sizeof(kernels[0])); k++) {
+	char name[32];
+
+	if (resample_use_kernel(kernels[k]))
+	    continue;
+
+	t = 0;
+	for (l = 0; l < loops; l++) {
+	    resampler_reset(rs);
+	    n = 0;
+	    t0 = now();
+	    for (i = 0; i < PERIODS; i++)
+		n += resampler_process(rs, in + i * PERIOD * 2, PERIOD,
+				       out + n * 2);
+	    t += now() - t0;
+	}
+
+	if (kernels[k] == SG_KERNEL_SCALAR) {
+	    memcpy(ref, out, n * 2 * sizeof(int16_t));
+	    ref_n = n;
+	} else if (n != ref_n || memcmp(ref, out, n * 2 * sizeof(int16_t))) {
+	    printf("%s: output differs from scalar\n", resample_kernel_name());
+	    resampler_free(rs);
+	    return -1;
+	}
+
+	snprintf(name, sizeof(name), "polyphase %s", resample_kernel_name());
+	report(name, t, PERIODS * loops, in_rate, snr(out, n, out_rate));
+    }
+    resampler_free(rs);
+
+    t = 0;
+    for (l = 0; l < loops; l++) {
+	memset(&lr, 0, sizeof(lr));
+	lr.step = ((uint64_t)in_rate << 16) / out_rate;
+	n = 0;
+	t0 = now();
+	for (i = 0; i < PERIODS; i++)
+	    n += linear_process(&lr, in + i * PERIOD * 2, PERIOD, out + n * 2);
+	t += now() - t0;
+    }
+    report("linear (plug)", t, PERIODS * loops, in_rate, snr(out, n, out_rate));
+
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    int loops = 200;
+
+    if (argc > 1)
+	loops = atoi(argv[1]);
+
+    if (run(44100, 48000, loops) || run(48000, 44100, loops))
+	return 1;
+
+    return 0;
+}
@@ -16,122 +16,240 @@
  * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
  */
 
+#include <errno.h>
+#include <string.h>
+#include <sched.h>
+#include <unistd.h>
+
 #include "ring.h"
-#include "mb.h"
 
-static int ring_check_indexes(XC_RING_IDX cons, XC_RING_IDX prod)
+/*
+ * The indexes live in a page shared with the guest, so they stay plain
+ * integers and are accessed through the C11 memory model builtins. Each
+ * side only ever stores its own index.
+ */
+static XC_RING_IDX ring_load_acquire(XC_RING_IDX *idx)
 {
-	return ((prod - cons) <= XC_RING_SIZE);
+	return __atomic_load_n(idx, __ATOMIC_ACQUIRE);
 }
-static void *ring_get_output_chunk(XC_RING_IDX cons,
-			      XC_RING_IDX prod,
-			      char *buf, uint32_t *len)
+
+static XC_RING_IDX ring_load_own(XC_RING_IDX *idx)
 {
-	*len = XC_RING_SIZE - MASK_XC_RING_IDX(prod);
-	if ((XC_RING_SIZE - (prod - cons)) < *len)
-		*len = XC_RING_SIZE - (prod - cons);
-	return buf + MASK_XC_RING_IDX(prod);
+	return __atomic_load_n(idx, __ATOMIC_RELAXED);
 }
 
-static const void *ring_get_input_chunk(XC_RING_IDX cons,
-				   XC_RING_IDX prod,
-				   const char *buf, uint32_t *len)
+static void ring_store_release(XC_RING_IDX *idx, XC_RING_IDX val)
 {
-	*len = XC_RING_SIZE - MASK_XC_RING_IDX(cons);
-	if ((prod - cons) < *len)
-		*len = prod - cons;
-	return buf + MASK_XC_RING_IDX(cons);
+	__atomic_store_n(idx, val, __ATOMIC_RELEASE);
 }
 
-int ring_data_to_read(struct ring_t *intf)
+static void ring_copy_out(void *data, const char *buf, XC_RING_IDX cons,
+			  unsigned int len)
 {
-	return (intf->req_cons != intf->req_prod);
+	unsigned int off = MASK_XC_RING_IDX(cons);
+	unsigned int first = XC_RING_SIZE - off;
+
+	if (first > len)
+		first = len;
+	memcpy(data, buf + off, first);
+	memcpy((char *)data + first, buf, len - first);
 }
-int ring_write(struct ring_t *intf, const void *data, unsigned int len)
+
+static void ring_copy_in(char *buf, XC_RING_IDX prod, const void *data,
+			 unsigned int len)
+{
+	unsigned int off = MASK_XC_RING_IDX(prod);
+	unsigned int first = XC_RING_SIZE - off;
+
+	if (first > len)
+		first = len;
+	memcpy(buf + off, data, first);
+	memcpy(buf, (const char *)data + first, len - first);
+}
+
+/*
+ * Consume up to max whole records of size bytes. Returns the number of
+ * records copied, 0 if not even one is there yet, -1 if the producer
+ * index is bogus, in which case everything pending is dropped.
+ */
+static int ring_get(const char *buf, XC_RING_IDX *cons_p, XC_RING_IDX *prod_p,
+		    void *data, unsigned int size, unsigned int max)
 {
 	XC_RING_IDX cons, prod;
-	int rc;
+	unsigned int n;
 
-	if ((intf->rsp_prod - intf->rsp_cons) == XC_RING_SIZE)
+	cons = ring_load_own(cons_p);
+	prod = ring_load_acquire(prod_p);
+
+	if ((prod - cons) > XC_RING_SIZE) {
+		ring_store_release(cons_p, prod);
+		errno = EIO;
 		return -1;
+	}
 
-	while (len != 0) {
-		void *dst;
-		unsigned int avail;
+	n = (prod - cons) / size;
+	if (n > max)
+		n = max;
+	if (n == 0)
+		return 0;
 
-		cons = intf->rsp_cons;
-		prod = intf->rsp_prod;
-		if (!ring_check_indexes(cons, prod)) {
-			intf->rsp_cons = intf->rsp_prod = 0;
-			return -1;
-		}
-		dst = ring_get_output_chunk(cons, prod, intf->rsp, &avail);
-		if (avail < len)
-			return -1; /* FIXME ! wait here ? */
-		if (avail > len)
-			avail = len;
+	ring_copy_out(data, buf, cons, n * size);
+	ring_store_release(cons_p, cons + n * size);
 
-		mb();
+	return n;
+}
 
-		memcpy(dst, data, avail);
-		data += avail;
-		len -= avail;
+/*
+ * Produce len bytes, all or nothing. Fails with EAGAIN when short of
+ * space, EIO if the consumer index is bogus.
+ */
+static int ring_put(char *buf, XC_RING_IDX *cons_p, XC_RING_IDX *prod_p,
+		    const void *data, unsigned int len)
+{
+	XC_RING_IDX cons, prod;
 
-		wmb();
-		intf->rsp_prod += avail;
+	prod = ring_load_own(prod_p);
+	cons = ring_load_acquire(cons_p);
 
+	if ((prod - cons) > XC_RING_SIZE) {
+		errno = EIO;
+		return -1;
+	}
+	if (XC_RING_SIZE - (prod - cons) < len) {
+		errno = EAGAIN;
+		return -1;
 	}
 
+	ring_copy_in(buf, prod, data, len);
+	ring_store_release(prod_p, prod + len);
+
 	return 0;
 }
 
+int ring_data_to_read(struct ring_t *intf)
+{
+	return ring_load_acquire(&intf->req_prod) != ring_load_own(&intf->req_cons);
+}
+
 int ring_read(struct ring_t *intf, void *data, unsigned len)
 {
-	XC_RING_IDX cons, prod;
-	int rc = len;
+	int rc;
 
-	while (len != 0) {
-		unsigned int avail;
-		const char *src;
+	if (len == 0 || len > XC_RING_SIZE) {
+		errno = EINVAL;
+		return -1;
+	}
 
-		if (!ring_data_to_read(intf))
-			return 0;
+	rc = ring_get(intf->req, &intf->req_cons, &intf->req_prod, data, len, 1);
+	if (rc <= 0)
+		return rc;
 
-		cons = intf->req_cons;
-		prod = intf->req_prod;
-		if (!ring_check_indexes(cons, prod)) {
-			intf->req_cons = intf->req_prod = 0;
-			return -1;
-		}
+	return len;
+}
+
+/*
+ * Batched read of fixed size records, one index update for the lot.
+ * Partial records are left in the ring until the frontend completes them.
+ */
+int ring_read_batch(struct ring_t *intf, void *data, unsigned int size,
+		    unsigned int max)
+{
+	if (size == 0 || size > XC_RING_SIZE) {
+		errno = EINVAL;
+		return -1;
+	}
 
-		src = ring_get_input_chunk(cons, prod, intf->req, &avail);
-		if (avail == 0)
-			continue;
-		if (avail > len)
-			avail = len;
+	return ring_get(intf->req, &intf->req_cons, &intf->req_prod, data,
+			size, max);
+}
 
-		rmb();
+unsigned int ring_write_space(struct ring_t *intf)
+{
+	XC_RING_IDX used;
 
-		memcpy(data, src, avail);
-		data += avail;
-		len -= avail;
+	used = ring_load_own(&intf->rsp_prod) -
+	       ring_load_acquire(&intf->rsp_cons);
+	if (used > XC_RING_SIZE)
+		return 0;
 
-		mb();
-		intf->req_cons += avail;
+	return XC_RING_SIZE - used;
+}
 
+int ring_write(struct ring_t *intf, const void *data, unsigned int len)
+{
+	if (len > XC_RING_SIZE) {
+		errno = EMSGSIZE;
+		return -1;
 	}
 
-	return rc;
+	return ring_put(intf->rsp, &intf->rsp_cons, &intf->rsp_prod, data, len);
 }
 
-void ring_init(struct ring_t *intf)
+/* Spin briefly, then yield, then sleep: the frontend may be descheduled. */
+static void ring_backoff(unsigned int round)
 {
-	intf->rsp_cons = intf->rsp_prod = 0;
-	intf->req_cons = intf->req_prod = 0;
+	if (round < 64)
+		__atomic_signal_fence(__ATOMIC_SEQ_CST);
+	else if (round < 1024)
+		sched_yield();
+	else
+		usleep(100);
 }
 
+/*
+ * Blocking write. Without a wait function this polls the consumer index
+ * with backoff; with one, it sleeps in it until the consumer signals it
+ * freed space (wake-on-space), e.g. on the event channel.
+ */
+int ring_write_wait(struct ring_t *intf, const void *data, unsigned int len,
+		    ring_wait_fn wait, void *opaque)
+{
+	unsigned int round;
 
+	for (round = 0;; round++) {
+		if (!ring_write(intf, data, len))
+			return 0;
+		if (errno != EAGAIN)
+			return -1;
 
+		if (wait) {
+			if (wait(intf, len, opaque))
+				return -1;
+		} else
+			ring_backoff(round);
+	}
+}
+
+int ring_frontend_write(struct ring_t *intf, const void *data,
+			unsigned int len)
+{
+	if (len > XC_RING_SIZE) {
+		errno = EMSGSIZE;
+		return -1;
+	}
 
+	return ring_put(intf->req, &intf->req_cons, &intf->req_prod, data, len);
+}
 
+int ring_frontend_read(struct ring_t *intf, void *data, unsigned int len)
+{
+	int rc;
 
+	if (len == 0 || len > XC_RING_SIZE) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	rc = ring_get(intf->rsp, &intf->rsp_cons, &intf->rsp_prod, data, len, 1);
+	if (rc <= 0)
+		return rc;
+
+	return len;
+}
+
+void ring_init(struct ring_t *intf)
+{
+	intf->rsp_cons = intf->rsp_prod = 0;
+	intf->req_cons = intf->req_prod = 0;
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
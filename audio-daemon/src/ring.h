@@ -25,6 +25,14 @@ typedef uint32_t XC_RING_IDX;
 #define XC_RING_SIZE 1024
 #define MASK_XC_RING_IDX(idx) ((idx) & (XC_RING_SIZE-1))
 
+/*
+ * Command ring shared with the frontend, the layout is ABI.
+ *
+ * Each direction is a single producer, single consumer byte ring. The
+ * producer fills the buffer then publishes prod with a release store, the
+ * consumer reads prod with an acquire load, copies out and hands the space
+ * back with a release store to cons. Indexes are free running.
+ */
 struct ring_t {
     char req[XC_RING_SIZE]; /* Requests */
     char rsp[XC_RING_SIZE]; /* Replies  */
@@ -32,10 +40,26 @@ struct ring_t {
     XC_RING_IDX rsp_cons, rsp_prod;
 };
 
+/*
+ * Called by ring_write_wait() while the reply ring is short of need bytes.
+ * Returns once space may have been freed, or -1 to give up.
+ */
+typedef int (*ring_wait_fn)(struct ring_t *intf, unsigned int need,
+                            void *opaque);
+
 void ring_init(struct ring_t *intf);
 int ring_data_to_read(struct ring_t *intf);
 int ring_read(struct ring_t *intf, void *data, unsigned len);
+int ring_read_batch(struct ring_t *intf, void *data, unsigned int size,
+                    unsigned int max);
+unsigned int ring_write_space(struct ring_t *intf);
 int ring_write(struct ring_t *intf, const void *data, unsigned int len);
+int ring_write_wait(struct ring_t *intf, const void *data, unsigned int len,
+                    ring_wait_fn wait, void *opaque);
 
-#endif
+/* Frontend half, for emulating the guest driver without Xen. */
+int ring_frontend_write(struct ring_t *intf, const void *data,
+                        unsigned int len);
+int ring_frontend_read(struct ring_t *intf, void *data, unsigned int len);
 
+#endif
@@ -0,0 +1,290 @@
+/*
+ * ring_bench.c:
+ *
+ *
+ */
+
+/*
+ * Copyright (c) 2012 Citrix Systems, Inc.
+ * 
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * Command ring stress test and benchmark, no Xen needed.
+ *
+ * Two threads share a ring_t in ordinary memory. One plays the frontend
+ * and posts sequenced fe_cmd records, the other plays audio-daemon and
+ * drains them with ring_read_batch(), checking that nothing is lost,
+ * duplicated or reordered. The reply direction is then driven through
+ * ring_write_wait(), polling and wake-on-space.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sched.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/eventfd.h>
+
+#include "ring.h"
+
+/* Same wire format as audio-daemon.h, which needs ALSA to include. */
+struct fe_cmd {
+    uint8_t stream;
+    uint8_t cmd;
+    uint8_t data[6];
+    uint64_t s_time;
+} __attribute__((packed));
+
+#define MAX_BATCH 64
+
+struct waker {
+    int efd;
+    int waiting;
+    unsigned long sleeps;
+};
+
+struct bench {
+    struct ring_t ring;
+    unsigned long count;
+    unsigned int batch;
+    struct waker *waker;
+    unsigned long errors;
+    unsigned long empty;
+};
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void relax(unsigned int *round)
+{
+    if (++*round > 64) {
+	sched_yield();
+	*round = 0;
+    }
+}
+
+/*
+ * Frontend to backend: the command path audio-daemon uses.
+ */
+static void *frontend_producer(void *arg)
+{
+    struct bench *b = arg;
+    struct fe_cmd cmd;
+    unsigned long seq;
+    unsigned int round = 0;
+
+    memset(&cmd, 0, sizeof(cmd));
+    for (seq = 0; seq < b->count; seq++) {
+	cmd.stream = seq & 1;
+	cmd.cmd = seq % 5;
+	cmd.s_time = seq;
+	while (ring_frontend_write(&b->ring, &cmd, sizeof(cmd))) {
+	    if (errno != EAGAIN) {
+		b->errors++;
+		return NULL;
+	    }
+	    relax(&round);
+	}
+    }
+
+    return NULL;
+}
+
+static void backend_consumer(struct bench *b)
+{
+    struct fe_cmd cmds[MAX_BATCH];
+    unsigned long seq = 0;
+    unsigned int round = 0;
+    int i, n;
+
+    while (seq < b->count) {
+	if (b->batch == 1)
+	    n = ring_read(&b->ring, cmds, sizeof(cmds[0])) > 0;
+	else
+	    n = ring_read_batch(&b->ring, cmds, sizeof(cmds[0]), b->batch);
+	if (n < 0) {
+	    b->errors++;
+	    return;
+	}
+	if (n == 0) {
+	    b->empty++;
+	    relax(&round);
+	    continue;
+	}
+	for (i = 0; i < n; i++, seq++) {
+	    if (cmds[i].s_time != seq || cmds[i].stream != (seq & 1) ||
+		cmds[i].cmd != seq % 5)
+		b->errors++;
+	}
+    }
+}
+
+/*
+ * Backend to frontend: replies, with the writer blocking on a full ring.
+ */
+static int wait_for_space(struct ring_t *intf, unsigned int need, void *opaque)
+{
+    struct waker *w = opaque;
+    uint64_t v;
+
+    __atomic_store_n(&w->waiting, 1, __ATOMIC_SEQ_CST);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (ring_write_space(intf) >= need) {
+	__atomic_store_n(&w->waiting, 0, __ATOMIC_SEQ_CST);
+	return 0;
+    }
+
+    w->sleeps++;
+    if (read(w->efd, &v, sizeof(v)) != sizeof(v))
+	return -1;
+
+    return 0;
+}
+
+static void space_freed(struct waker *w)
+{
+    uint64_t v = 1;
+
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&w->waiting, __ATOMIC_RELAXED) &&
+	__atomic_exchange_n(&w->waiting, 0, __ATOMIC_SEQ_CST))
+	write(w->efd, &v, sizeof(v));
+}
+
+static void *frontend_consumer(void *arg)
+{
+    struct bench *b = arg;
+    struct fe_cmd cmd;
+    unsigned long seq = 0;
+    unsigned int round = 0;
+    int rc;
+
+    while (seq < b->count) {
+	rc = ring_frontend_read(&b->ring, &cmd, sizeof(cmd));
+	if (rc < 0) {
+	    b->errors++;
+	    break;
+	}
+	if (rc == 0) {
+	    b->empty++;
+	    relax(&round);
+	    continue;
+	}
+	if (b->waker)
+	    space_freed(b->waker);
+	if (cmd.s_time != seq++)
+	    b->errors++;
+    }
+
+    return NULL;
+}
+
+static void backend_producer(struct bench *b)
+{
+    struct fe_cmd cmd;
+    unsigned long seq;
+
+    memset(&cmd, 0, sizeof(cmd));
+    for (seq = 0; seq < b->count; seq++) {
+	cmd.s_time = seq;
+	if (ring_write_wait(&b->ring, &cmd, sizeof(cmd),
+			    b->waker ? wait_for_space : NULL, b->waker)) {
+	    b->errors++;
+	    return;
+	}
+    }
+}
+
+static int run(const char *name, unsigned long count, unsigned int batch,
+	       int reply, int wake)
+{
+    struct bench *b;
+    struct waker w;
+    pthread_t thread;
+    double t0, t1;
+    int rc;
+
+    b = calloc(1, sizeof(*b));
+    if (!b)
+	return -1;
+    ring_init(&b->ring);
+    b->count = count;
+    b->batch = batch;
+
+    memset(&w, 0, sizeof(w));
+    if (wake) {
+	w.efd = eventfd(0, 0);
+	if (w.efd < 0) {
+	    perror("eventfd");
+	    free(b);
+	    return -1;
+	}
+	b->waker = &w;
+    }
+
+    t0 = now();
+    if (pthread_create(&thread, NULL,
+		       reply ? frontend_consumer : frontend_producer, b)) {
+	free(b);
+	return -1;
+    }
+    if (reply)
+	backend_producer(b);
+    else
+	backend_consumer(b);
+    pthread_join(thread, NULL);
+    t1 = now();
+
+    printf("%-24s %lu cmds in %.3fs, %6.2f Mcmd/s, %lu empty polls",
+	   name, count, t1 - t0, count / (t1 - t0) / 1e6, b->empty);
+    if (wake)
+	printf(", %lu sleeps", w.sleeps);
+    printf("%s\n", b->errors ? ", ERRORS" : "");
+
+    rc = b->errors ? -1 : 0;
+    if (wake)
+	close(w.efd);
+    free(b);
+
+    return rc;
+}
+
+int main(int argc, char *argv[])
+{
+    unsigned long count = 10000000;
+    int rc = 0;
+
+    if (argc > 1)
+	count = strtoul(argv[1], NULL, 0);
+
+    rc |= run("cmd ring_read", count, 1, 0, 0);
+    rc |= run("cmd ring_read_batch 16", count, 16, 0, 0);
+    rc |= run("cmd ring_read_batch 64", count, 64, 0, 0);
+    rc |= run("reply write_wait poll", count, 0, 1, 0);
+    rc |= run("reply write_wait wake", count, 0, 1, 1);
+
+    return rc ? 1 : 0;
+}
@@ -0,0 +1,286 @@
+/*
+ * sg.c:
+ *
+ *
+ */
+
+/*
+ * Copyright (c) 2012 Citrix Systems, Inc.
+ * 
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__i386__) || defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+#include "sg.h"
+
+typedef void (*sg_gain_fn)(int16_t *dst, const int16_t *src, int samples,
+                           int gain0, int gain1);
+typedef void (*sg_mix_fn)(int16_t *dst, const int16_t *src, int samples);
+
+static inline int16_t gain_sample(int16_t x, int gain)
+{
+    int32_t v = ((int32_t)x * gain + (1 << (SG_GAIN_SHIFT - 1))) >> SG_GAIN_SHIFT;
+
+    if (v > INT16_MAX)
+	return INT16_MAX;
+    if (v < INT16_MIN)
+	return INT16_MIN;
+    return v;
+}
+
+static void gain_scalar(int16_t *dst, const int16_t *src, int samples,
+                        int gain0, int gain1)
+{
+    int i;
+
+    for (i = 0; i + 1 < samples; i += 2) {
+	dst[i] = gain_sample(src[i], gain0);
+	dst[i + 1] = gain_sample(src[i + 1], gain1);
+    }
+    if (i < samples)
+	dst[i] = gain_sample(src[i], gain0);
+}
+
+static void mix_scalar(int16_t *dst, const int16_t *src, int samples)
+{
+    int i;
+
+    for (i = 0; i < samples; i++) {
+	int32_t v = dst[i] + src[i];
+
+	dst[i] = v > INT16_MAX ? INT16_MAX : v < INT16_MIN ? INT16_MIN : v;
+    }
+}
+
+#if defined(__SSE2__)
+/*
+ * 16x16->32 products from mullo/mulhi, rounded, shifted back and packed
+ * with saturation. Lanes alternate gain0/gain1 like the samples do.
+ */
+static void gain_sse2(int16_t *dst, const int16_t *src, int samples,
+                      int gain0, int gain1)
+{
+    const __m128i g = _mm_set1_epi32((gain1 << 16) | (gain0 & 0xffff));
+    const __m128i round = _mm_set1_epi32(1 << (SG_GAIN_SHIFT - 1));
+    int i;
+
+    for (i = 0; i + 8 <= samples; i += 8) {
+	__m128i x = _mm_loadu_si128((const __m128i *)(src + i));
+	__m128i lo = _mm_mullo_epi16(x, g);
+	__m128i hi = _mm_mulhi_epi16(x, g);
+	__m128i p0 = _mm_unpacklo_epi16(lo, hi);
+	__m128i p1 = _mm_unpackhi_epi16(lo, hi);
+
+	p0 = _mm_srai_epi32(_mm_add_epi32(p0, round), SG_GAIN_SHIFT);
+	p1 = _mm_srai_epi32(_mm_add_epi32(p1, round), SG_GAIN_SHIFT);
+	_mm_storeu_si128((__m128i *)(dst + i), _mm_packs_epi32(p0, p1));
+    }
+    gain_scalar(dst + i, src + i, samples - i, gain0, gain1);
+}
+
+static void mix_sse2(int16_t *dst, const int16_t *src, int samples)
+{
+    int i;
+
+    for (i = 0; i + 8 <= samples; i += 8) {
+	__m128i a = _mm_loadu_si128((const __m128i *)(dst + i));
+	__m128i b = _mm_loadu_si128((const __m128i *)(src + i));
+
+	_mm_storeu_si128((__m128i *)(dst + i), _mm_adds_epi16(a, b));
+    }
+    mix_scalar(dst + i, src + i, samples - i);
+}
+#endif
+
+#if defined(__i386__) || defined(__x86_64__)
+/* Same as SSE2, 16 samples at a time. Unpack and pack both work within
+ * 128 bit lanes, so the sample order comes out unchanged. */
+__attribute__((target("avx2")))
+static void gain_avx2(int16_t *dst, const int16_t *src, int samples,
+                      int gain0, int gain1)
+{
+    const __m256i g = _mm256_set1_epi32((gain1 << 16) | (gain0 & 0xffff));
+    const __m256i round = _mm256_set1_epi32(1 << (SG_GAIN_SHIFT - 1));
+    int i;
+
+    for (i = 0; i + 16 <= samples; i += 16) {
+	__m256i x = _mm256_loadu_si256((const __m256i *)(src + i));
+	__m256i lo = _mm256_mullo_epi16(x, g);
+	__m256i hi = _mm256_mulhi_epi16(x, g);
+	__m256i p0 = _mm256_unpacklo_epi16(lo, hi);
+	__m256i p1 = _mm256_unpackhi_epi16(lo, hi);
+
+	p0 = _mm256_srai_epi32(_mm256_add_epi32(p0, round), SG_GAIN_SHIFT);
+	p1 = _mm256_srai_epi32(_mm256_add_epi32(p1, round), SG_GAIN_SHIFT);
+	_mm256_storeu_si256((__m256i *)(dst + i), _mm256_packs_epi32(p0, p1));
+    }
+    gain_scalar(dst + i, src + i, samples - i, gain0, gain1);
+}
+
+__attribute__((target("avx2")))
+static void mix_avx2(int16_t *dst, const int16_t *src, int samples)
+{
+    int i;
+
+    for (i = 0; i + 16 <= samples; i += 16) {
+	__m256i a = _mm256_loadu_si256((const __m256i *)(dst + i));
+	__m256i b = _mm256_loadu_si256((const __m256i *)(src + i));
+
+	_mm256_storeu_si256((__m256i *)(dst + i), _mm256_adds_epi16(a, b));
+    }
+    mix_scalar(dst + i, src + i, samples - i);
+}
+#endif
+
+static sg_gain_fn sg_gain;
+static sg_mix_fn sg_mix;
+static const char *sg_gain_name;
+
+int sg_use_kernel(enum sg_kernel kernel)
+{
+    if (kernel == SG_KERNEL_AUTO) {
+#if defined(__i386__) || defined(__x86_64__)
+	if (__builtin_cpu_supports("avx2"))
+	    return sg_use_kernel(SG_KERNEL_AVX2);
+#endif
+#if defined(__SSE2__)
+	return sg_use_kernel(SG_KERNEL_SSE2);
+#else
+	return sg_use_kernel(SG_KERNEL_SCALAR);
+#endif
+    }
+
+    switch (kernel) {
+    case SG_KERNEL_SCALAR:
+	sg_gain = gain_scalar;
+	sg_mix = mix_scalar;
+	sg_gain_name = "scalar";
+	return 0;
+#if defined(__SSE2__)
+    case SG_KERNEL_SSE2:
+	sg_gain = gain_sse2;
+	sg_mix = mix_sse2;
+	sg_gain_name = "sse2";
+	return 0;
+#endif
+#if defined(__i386__) || defined(__x86_64__)
+    case SG_KERNEL_AVX2:
+	if (!__builtin_cpu_supports("avx2"))
+	    return -1;
+	sg_gain = gain_avx2;
+	sg_mix = mix_avx2;
+	sg_gain_name = "avx2";
+	return 0;
+#endif
+    default:
+	return -1;
+    }
+}
+
+const char *sg_kernel_name(void)
+{
+    return sg_gain_name;
+}
+
+void sg_copy_s16(int16_t *dst, const int16_t *src, int samples,
+                 int gain0, int gain1)
+{
+    if (gain0 == SG_GAIN_UNITY && gain1 == SG_GAIN_UNITY) {
+	memcpy(dst, src, samples * sizeof(int16_t));
+	return;
+    }
+    if (gain0 == 0 && gain1 == 0) {
+	memset(dst, 0, samples * sizeof(int16_t));
+	return;
+    }
+
+    sg_gain(dst, src, samples, gain0, gain1);
+}
+
+/* dst += src, saturating. This is the mixer for several guests' playback. */
+void sg_mix_s16(int16_t *dst, const int16_t *src, int samples)
+{
+    sg_mix(dst, src, samples);
+}
+
+/*
+ * Walk the ring of ring bytes from offset, one run per page, wrapping at
+ * the end of the ring even mid page. A run starting on an odd sample
+ * starts on the right channel, so the gains swap for it. An offset past
+ * the end is taken modulo ring. Returns the new offset, wrapped.
+ */
+int sg_read(int16_t *dst, void *const *pages, int ring, int offset,
+            int bytes, int gain_l, int gain_r)
+{
+    bytes &= ~1;
+    offset %= ring;
+    while (bytes > 0) {
+	int run = SG_PAGE_SIZE - offset % SG_PAGE_SIZE;
+	const int16_t *src;
+	int odd = (offset / 2) & 1;
+
+	if (run > ring - offset)
+	    run = ring - offset;
+	if (run > bytes)
+	    run = bytes;
+	src = (const int16_t *)((const char *)pages[offset / SG_PAGE_SIZE] +
+	                        offset % SG_PAGE_SIZE);
+	sg_copy_s16(dst, src, run / 2, odd ? gain_r : gain_l,
+	            odd ? gain_l : gain_r);
+
+	dst += run / 2;
+	bytes -= run;
+	offset += run;
+	if (offset == ring)
+	    offset = 0;
+    }
+
+    return offset;
+}
+
+int sg_write(void *const *pages, int ring, int offset, const int16_t *src,
+             int bytes, int gain_l, int gain_r)
+{
+    bytes &= ~1;
+    offset %= ring;
+    while (bytes > 0) {
+	int run = SG_PAGE_SIZE - offset % SG_PAGE_SIZE;
+	int16_t *dst;
+	int odd = (offset / 2) & 1;
+
+	if (run > ring - offset)
+	    run = ring - offset;
+	if (run > bytes)
+	    run = bytes;
+	dst = (int16_t *)((char *)pages[offset / SG_PAGE_SIZE] +
+	                  offset % SG_PAGE_SIZE);
+	sg_copy_s16(dst, src, run / 2, odd ? gain_r : gain_l,
+	            odd ? gain_l : gain_r);
+
+	src += run / 2;
+	bytes -= run;
+	offset += run;
+	if (offset == ring)
+	    offset = 0;
+    }
+
+    return offset;
+}
@@ -0,0 +1,64 @@
+/*
+ * Copyright (c) 2012 Citrix Systems, Inc.
+ * 
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef _SG_H_
+#define _SG_H_
+
+#include <stdint.h>
+
+/*
+ * Copies between a contiguous S16 buffer and the guest DMA buffer, which is
+ * a ring of pages mapped one by one. Whole page runs are copied at once;
+ * the gain kernel only runs when the gain is neither unity nor mute, so
+ * per-channel volume costs no extra pass over the data.
+ */
+
+#define SG_PAGE_SIZE 4096 /* XENVSND_PAGE_SIZE */
+
+/* Q2.14 fixed point gain, up to just under 2.0. */
+#define SG_GAIN_SHIFT 14
+#define SG_GAIN_UNITY (1 << SG_GAIN_SHIFT)
+#define SG_GAIN_MAX 0x7fff
+
+enum sg_kernel {
+    SG_KERNEL_AUTO = 0,
+    SG_KERNEL_SCALAR,
+    SG_KERNEL_SSE2,
+    SG_KERNEL_AVX2,
+};
+
+/*
+ * Must be called before any copy with gain or mix, from a single thread:
+ * the kernel pointers are plain globals, read without synchronisation.
+ */
+int sg_use_kernel(enum sg_kernel kernel);
+const char *sg_kernel_name(void);
+
+/* gain0 applies to even samples (left), gain1 to odd ones (right). */
+void sg_copy_s16(int16_t *dst, const int16_t *src, int samples,
+                 int gain0, int gain1);
+
+void sg_mix_s16(int16_t *dst, const int16_t *src, int samples);
+
+/* ring is the buffer size in bytes, it need not be whole pages. */
+int sg_read(int16_t *dst, void *const *pages, int ring, int offset,
+            int bytes, int gain_l, int gain_r);
+int sg_write(void *const *pages, int ring, int offset, const int16_t *src,
+             int bytes, int gain_l, int gain_r);
+
+#endif
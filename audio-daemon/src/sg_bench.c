@@ -0,0 +1,244 @@
+/*
+ * sg_bench.c:
+ *
+ *
+ */
+
+/*
+ * Copyright (c) 2012 Citrix Systems, Inc.
+ * 
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * Scatter-gather copy microbenchmark, no Xen or ALSA needed.
+ *
+ * Times one period (1024 stereo frames) in and out of an 8 page DMA ring
+ * with the old per-sample loop and with sg_read()/sg_write(), at unity
+ * gain and with each gain kernel, plus the saturating mix of one guest
+ * period into another, after checking every kernel against scalar code.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include "sg.h"
+
+#define NPAGES 8
+#define RING (NPAGES * SG_PAGE_SIZE)
+#define PERIOD_BYTES (1024 * 4)
+
+static void *pages[NPAGES];
+static int16_t period[PERIOD_BYTES / 2];
+static int16_t expect[PERIOD_BYTES / 2];
+
+/* The loop get_data_from_sg() used to run, volume fixed at 100. */
+static int old_get(int16_t *dst, int size, int hw_ptr)
+{
+    int16_t *src;
+    int val = 100;
+
+    size = size / 2;
+    while (size--) {
+	src = pages[hw_ptr / SG_PAGE_SIZE] + hw_ptr % SG_PAGE_SIZE;
+	*dst++ = (*src) * val / 100;
+	hw_ptr += 2;
+	if (hw_ptr == SG_PAGE_SIZE * NPAGES)
+	    hw_ptr = 0;
+    }
+    return hw_ptr;
+}
+
+static int old_put(const int16_t *src, int size, int hw_ptr)
+{
+    int16_t *dst;
+    int val = 100;
+
+    size = size / 2;
+    while (size--) {
+	dst = pages[hw_ptr / SG_PAGE_SIZE] + hw_ptr % SG_PAGE_SIZE;
+	*dst = (*src++) * val / 100;
+	hw_ptr += 2;
+	if (hw_ptr == SG_PAGE_SIZE * NPAGES)
+	    hw_ptr = 0;
+    }
+    return hw_ptr;
+}
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Odd offsets exercise runs that straddle pages and start on the right
+ * channel, the short ring one that wraps mid page. */
+static int check_ring(int ring, int gain_l, int gain_r)
+{
+    int offsets[] = { 0, 2, 4094, ring - 6 };
+    unsigned int i;
+    int j, off;
+
+    for (i = 0; i < sizeof(offsets) / sizeof(offsets[0]); i++) {
+	off = offsets[i];
+	sg_read(period, pages, ring, off, PERIOD_BYTES, gain_l, gain_r);
+	for (j = 0; j < PERIOD_BYTES / 2; j++) {
+	    int16_t x = *(int16_t *)((char *)pages[off / SG_PAGE_SIZE] +
+				     off % SG_PAGE_SIZE);
+	    int g = ((off / 2) & 1) ? gain_r : gain_l;
+	    int32_t v = ((int32_t)x * g + (1 << (SG_GAIN_SHIFT - 1))) >>
+			SG_GAIN_SHIFT;
+
+	    if (v > INT16_MAX)
+		v = INT16_MAX;
+	    if (v < INT16_MIN)
+		v = INT16_MIN;
+	    expect[j] = v;
+	    off = (off + 2) % ring;
+	}
+	if (memcmp(period, expect, sizeof(period))) {
+	    printf("%s: mismatch at offset %d of %d, gain %d/%d\n",
+		   sg_kernel_name(), offsets[i], ring, gain_l, gain_r);
+	    return -1;
+	}
+    }
+
+    return 0;
+}
+
+static int check(int gain_l, int gain_r)
+{
+    return check_ring(RING, gain_l, gain_r) ||
+	check_ring(3 * SG_PAGE_SIZE + 1000, gain_l, gain_r);
+}
+
+/* Saturating mix against a scalar sum, odd length to hit the tail. */
+static int check_mix(void)
+{
+    static int16_t a[PERIOD_BYTES / 2 - 3], b[PERIOD_BYTES / 2 - 3];
+    int j, n = PERIOD_BYTES / 2 - 3;
+
+    for (j = 0; j < n; j++) {
+	int32_t v;
+
+	a[j] = rand();
+	b[j] = (j & 3) == 0 ? INT16_MAX : (j & 3) == 1 ? INT16_MIN : rand();
+	v = a[j] + b[j];
+	expect[j] = v > INT16_MAX ? INT16_MAX : v < INT16_MIN ? INT16_MIN : v;
+    }
+    sg_mix_s16(a, b, n);
+    if (memcmp(a, expect, n * sizeof(a[0]))) {
+	printf("%s: mix mismatch\n", sg_kernel_name());
+	return -1;
+    }
+
+    return 0;
+}
+
+static void report(const char *name, double t, unsigned long iters,
+		   double base)
+{
+    double ns = t / iters * 1e9;
+
+    printf("  %-22s %8.0f ns/period", name, ns);
+    if (base > 0)
+	printf("  %5.1fx", base / ns);
+    printf("\n");
+}
+
+int main(int argc, char *argv[])
+{
+    unsigned long iters = 200000, i;
+    enum sg_kernel kernels[] = { SG_KERNEL_SCALAR, SG_KERNEL_SSE2,
+				 SG_KERNEL_AVX2 };
+    double t0, base_get, base_put;
+    int k, off;
+
+    if (argc > 1)
+	iters = strtoul(argv[1], NULL, 0);
+
+    srand(1);
+    for (k = 0; k < NPAGES; k++) {
+	int16_t *p = pages[k] = malloc(SG_PAGE_SIZE);
+
+	for (i = 0; i < SG_PAGE_SIZE / 2; i++)
+	    p[i] = rand();
+    }
+
+    printf("period of %d bytes, %d pages\n", PERIOD_BYTES, NPAGES);
+
+    off = 0;
+    t0 = now();
+    for (i = 0; i < iters; i++)
+	off = old_get(period, PERIOD_BYTES, off);
+    base_get = (now() - t0) / iters * 1e9;
+    report("old get, vol 100", base_get * iters / 1e9, iters, 0);
+
+    off = 0;
+    t0 = now();
+    for (i = 0; i < iters; i++)
+	off = old_put(period, PERIOD_BYTES, off);
+    base_put = (now() - t0) / iters * 1e9;
+    report("old put, vol 100", base_put * iters / 1e9, iters, 0);
+
+    off = 0;
+    t0 = now();
+    for (i = 0; i < iters; i++)
+	off = sg_read(period, pages, RING, off, PERIOD_BYTES,
+		      SG_GAIN_UNITY, SG_GAIN_UNITY);
+    report("sg_read, unity", now() - t0, iters, base_get);
+
+    off = 0;
+    t0 = now();
+    for (i = 0; i < iters; i++)
+	off = sg_write(pages, RING, off, period, PERIOD_BYTES,
+		       SG_GAIN_UNITY, SG_GAIN_UNITY);
+    report("sg_write, unity", now() - t0, iters, base_put);
+
+    for (k = 0; k < (int)(sizeof(kernels) / sizeof(kernels[0])); k++) {
+	char name[64];
+
+	if (sg_use_kernel(kernels[k])) {
+	    printf("  %s not supported here\n",
+		   kernels[k] == SG_KERNEL_AVX2 ? "avx2" : "sse2");
+	    continue;
+	}
+	if (check(SG_GAIN_UNITY / 2, SG_GAIN_UNITY * 3 / 4) ||
+	    check(SG_GAIN_MAX, 0) || check(SG_GAIN_UNITY, SG_GAIN_UNITY / 3) ||
+	    check(0, 0) || check_mix())
+	    return 1;
+
+	off = 0;
+	t0 = now();
+	for (i = 0; i < iters; i++)
+	    off = sg_read(period, pages, RING, off, PERIOD_BYTES,
+			  SG_GAIN_UNITY / 2, SG_GAIN_UNITY / 3);
+	snprintf(name, sizeof(name), "sg_read, gain %s", sg_kernel_name());
+	report(name, now() - t0, iters, base_get);
+
+	t0 = now();
+	for (i = 0; i < iters; i++)
+	    sg_mix_s16(expect, period, PERIOD_BYTES / 2);
+	snprintf(name, sizeof(name), "sg_mix_s16, %s", sg_kernel_name());
+	report(name, now() - t0, iters, 0);
+    }
+
+    return 0;
+}
@@ -483,6 +483,64 @@ int openxt_alsa_readi(Settings *settings, void *buffer, int32_t num, int32_t siz
     return ret;
 }
 
+///
+/// Get the descriptors to poll for the PCM. ALSA may need more than one,
+/// and what they report has to be translated with openxt_alsa_poll_revents.
+///
+/// @param settings a pointer to the settings structure
+/// @param pfds where to put the descriptors
+/// @param space the number of descriptors pfds can hold
+/// @return -EINVAL settings == NULL
+///         -EINVAL pfds == NULL
+///         -EINVAL PCM closed
+///         -ENOSPC if the PCM needs more than space descriptors
+///         number of descriptors on success
+///
+int openxt_alsa_poll_descriptors(Settings *settings, struct pollfd *pfds, int32_t space)
+{
+    int ret;
+
+    // Sanity checks
+    openxt_checkp(pfds, -EINVAL);
+    openxt_checkp(settings, -EINVAL);
+    openxt_checkp(settings->handle, -EINVAL);
+
+    ret = snd_pcm_poll_descriptors_count(settings->handle);
+    openxt_assert_ret(ret >= 0, ret, ret);
+    openxt_assert_ret(ret <= space, ret, -ENOSPC);
+
+    return snd_pcm_poll_descriptors(settings->handle, pfds, ret);
+}
+
+///
+/// Get the events poll() reported for the PCM's descriptors, as the PCM
+/// sees them (POLLOUT for playback, POLLIN for capture, POLLERR on xrun).
+///
+/// @param settings a pointer to the settings structure
+/// @param pfds the descriptors from openxt_alsa_poll_descriptors
+/// @param num the number of descriptors
+/// @return -EINVAL settings == NULL
+///         -EINVAL pfds == NULL
+///         -EINVAL PCM closed
+///         negative error code on failure
+///         the events on success
+///
+int openxt_alsa_poll_revents(Settings *settings, struct pollfd *pfds, int32_t num)
+{
+    int ret;
+    unsigned short revents = 0;
+
+    // Sanity checks
+    openxt_checkp(pfds, -EINVAL);
+    openxt_checkp(settings, -EINVAL);
+    openxt_checkp(settings->handle, -EINVAL);
+
+    ret = snd_pcm_poll_descriptors_revents(settings->handle, pfds, num, &revents);
+    openxt_assert_ret(ret == 0, ret, ret);
+
+    return revents;
+}
+
 /////////////////////////////////////////////////////////////////////////////////////////////////////////
 // Simple Element Functions                                                                            //
 /////////////////////////////////////////////////////////////////////////////////////////////////////////
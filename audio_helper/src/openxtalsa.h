@@ -28,6 +28,7 @@
 
 #include <stdint.h>
 #include <stdbool.h>
+#include <poll.h>
 #include <sys/types.h>
 
 #define MAX_NAME_LENGTH 256
@@ -81,6 +82,8 @@ int openxt_alsa_start(Settings *settings);
 int openxt_alsa_get_available(Settings *settings);
 int openxt_alsa_writei(Settings *settings, void *buffer, int32_t num, int32_t size);
 int openxt_alsa_readi(Settings *settings, void *buffer, int32_t num, int32_t size);
+int openxt_alsa_poll_descriptors(Settings *settings, struct pollfd *pfds, int32_t space);
+int openxt_alsa_poll_revents(Settings *settings, struct pollfd *pfds, int32_t num);
 
 // Simple Mixer
 int openxt_alsa_mixer_fini(Settings *settings);
@@ -0,0 +1,306 @@
+//
+// Copyright (c) 2015 Assured Information Security, Inc
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 2 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+//
+
+#include "openxtfifo.h"
+#include "openxtdebug.h"
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Settings Functions                                                                                  //
+/////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+///
+/// Create a FIFO that holds up to size frames of frame_size bytes each.
+///
+/// @param fifo pointer to the FIFO to be created
+/// @param size the number of frames the FIFO can hold
+/// @param frame_size the size of one frame in bytes
+/// @return -EINVAL fifo == NULL
+///         -EINVAL *fifo != NULL
+///         -EINVAL size <= 0 or frame_size <= 0
+///         -ENOMEM if out of memory
+///         0 on success
+///
+int openxt_fifo_create(OpenXTFifo **fifo, int32_t size, int32_t frame_size)
+{
+    // Sanity checks
+    openxt_checkp(fifo, -EINVAL);
+    openxt_assert(*fifo == NULL, -EINVAL);
+    openxt_assert(size > 0, -EINVAL);
+    openxt_assert(frame_size > 0, -EINVAL);
+
+    // Allocate the FIFO and its buffer.
+    *fifo = (OpenXTFifo *)calloc(1, sizeof(OpenXTFifo));
+    if (*fifo == NULL)
+        return -ENOMEM;
+
+    (*fifo)->buffer = (char *)malloc((size_t)size * frame_size);
+    if ((*fifo)->buffer == NULL) {
+        free(*fifo);
+        *fifo = NULL;
+        return -ENOMEM;
+    }
+
+    (*fifo)->size = size;
+    (*fifo)->frame_size = frame_size;
+
+    // Done
+    return 0;
+}
+
+///
+/// Destroy a FIFO that we previously created.
+///
+/// @param fifo a pointer to the FIFO
+/// @return 0 on success, or if the FIFO is already NULL
+///
+int openxt_fifo_destroy(OpenXTFifo *fifo)
+{
+    // Ignore if the FIFO is already destroyed
+    if (fifo == NULL)
+        return 0;
+
+    // Cleanup memory
+    free(fifo->buffer);
+    free(fifo);
+
+    // Done
+    return 0;
+}
+
+///
+/// Throw away everything in the FIFO, as when a stream is stopped.
+///
+/// @param fifo a pointer to the FIFO
+/// @return -EINVAL fifo == NULL
+///         0 on success
+///
+int openxt_fifo_reset(OpenXTFifo *fifo)
+{
+    // Sanity checks
+    openxt_checkp(fifo, -EINVAL);
+
+    fifo->head = 0;
+    fifo->fill = 0;
+
+    // Done
+    return 0;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////
+// State Functions                                                                                     //
+/////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+///
+/// @param fifo a pointer to the FIFO
+/// @return -EINVAL fifo == NULL
+///         the number of frames queued on success
+///
+int openxt_fifo_fill(OpenXTFifo *fifo)
+{
+    // Sanity checks
+    openxt_checkp(fifo, -EINVAL);
+
+    return fifo->fill;
+}
+
+///
+/// @param fifo a pointer to the FIFO
+/// @return -EINVAL fifo == NULL
+///         the number of frames that can still be queued on success
+///
+int openxt_fifo_space(OpenXTFifo *fifo)
+{
+    // Sanity checks
+    openxt_checkp(fifo, -EINVAL);
+
+    return fifo->size - fifo->fill;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Copy Functions                                                                                      //
+/////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+///
+/// Queue frames at the tail. Frames that do not fit are not queued, and
+/// are counted in dropped.
+///
+/// @param fifo a pointer to the FIFO
+/// @param frames the frames to queue
+/// @param num the number of frames
+/// @return -EINVAL fifo == NULL
+///         -EINVAL frames == NULL
+///         the number of frames queued on success
+///
+int openxt_fifo_push(OpenXTFifo *fifo, const void *frames, int32_t num)
+{
+    int32_t done = 0;
+    int32_t run;
+    void *tail;
+
+    // Sanity checks
+    openxt_checkp(fifo, -EINVAL);
+    openxt_checkp(frames, -EINVAL);
+
+    // The free space may wrap, in which case it takes two copies.
+    while (done < num && (run = openxt_fifo_reserve(fifo, &tail)) > 0) {
+
+        if (run > num - done)
+            run = num - done;
+        memcpy(tail, (const char *)frames + (size_t)done * fifo->frame_size,
+               (size_t)run * fifo->frame_size);
+        openxt_fifo_commit(fifo, run);
+
+        done += run;
+    }
+
+    fifo->dropped += num - done;
+
+    // Done
+    return done;
+}
+
+///
+/// Dequeue frames from the head.
+///
+/// @param fifo a pointer to the FIFO
+/// @param frames where to put the frames
+/// @param num the most frames to dequeue
+/// @return -EINVAL fifo == NULL
+///         -EINVAL frames == NULL
+///         the number of frames dequeued on success
+///
+int openxt_fifo_pop(OpenXTFifo *fifo, void *frames, int32_t num)
+{
+    int32_t done = 0;
+    int32_t run;
+    void *head;
+
+    // Sanity checks
+    openxt_checkp(fifo, -EINVAL);
+    openxt_checkp(frames, -EINVAL);
+
+    while (done < num && (run = openxt_fifo_peek(fifo, &head)) > 0) {
+
+        if (run > num - done)
+            run = num - done;
+        memcpy((char *)frames + (size_t)done * fifo->frame_size, head,
+               (size_t)run * fifo->frame_size);
+        openxt_fifo_consume(fifo, run);
+
+        done += run;
+    }
+
+    // Done
+    return done;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////
+// In Place Functions                                                                                  //
+/////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+///
+/// Get the frames at the head that can be read without wrapping.
+///
+/// @param fifo a pointer to the FIFO
+/// @param frames set to the first frame at the head
+/// @return -EINVAL fifo == NULL
+///         -EINVAL frames == NULL
+///         the number of contiguous frames on success
+///
+int openxt_fifo_peek(OpenXTFifo *fifo, void **frames)
+{
+    // Sanity checks
+    openxt_checkp(fifo, -EINVAL);
+    openxt_checkp(frames, -EINVAL);
+
+    *frames = fifo->buffer + (size_t)fifo->head * fifo->frame_size;
+
+    if (fifo->head + fifo->fill > fifo->size)
+        return fifo->size - fifo->head;
+
+    return fifo->fill;
+}
+
+///
+/// Drop frames from the head, once they have been used in place.
+///
+/// @param fifo a pointer to the FIFO
+/// @param num the number of frames
+/// @return -EINVAL fifo == NULL
+///         -EINVAL num < 0 or num > the frames queued
+///         0 on success
+///
+int openxt_fifo_consume(OpenXTFifo *fifo, int32_t num)
+{
+    // Sanity checks
+    openxt_checkp(fifo, -EINVAL);
+    openxt_assert(num >= 0 && num <= fifo->fill, -EINVAL);
+
+    fifo->head = (fifo->head + num) % fifo->size;
+    fifo->fill -= num;
+
+    // Done
+    return 0;
+}
+
+///
+/// Get the free frames at the tail that can be written without wrapping.
+///
+/// @param fifo a pointer to the FIFO
+/// @param frames set to the first free frame at the tail
+/// @return -EINVAL fifo == NULL
+///         -EINVAL frames == NULL
+///         the number of contiguous free frames on success
+///
+int openxt_fifo_reserve(OpenXTFifo *fifo, void **frames)
+{
+    int32_t tail;
+
+    // Sanity checks
+    openxt_checkp(fifo, -EINVAL);
+    openxt_checkp(frames, -EINVAL);
+
+    tail = (fifo->head + fifo->fill) % fifo->size;
+    *frames = fifo->buffer + (size_t)tail * fifo->frame_size;
+
+    if (tail + (fifo->size - fifo->fill) > fifo->size)
+        return fifo->size - tail;
+
+    return fifo->size - fifo->fill;
+}
+
+///
+/// Queue frames that were written in place at the tail.
+///
+/// @param fifo a pointer to the FIFO
+/// @param num the number of frames
+/// @return -EINVAL fifo == NULL
+///         -EINVAL num < 0 or num > the free frames
+///         0 on success
+///
+int openxt_fifo_commit(OpenXTFifo *fifo, int32_t num)
+{
+    // Sanity checks
+    openxt_checkp(fifo, -EINVAL);
+    openxt_assert(num >= 0 && num <= fifo->size - fifo->fill, -EINVAL);
+
+    fifo->fill += num;
+
+    // Done
+    return 0;
+}
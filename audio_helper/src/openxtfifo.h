@@ -0,0 +1,65 @@
+//
+// Copyright (c) 2015 Assured Information Security, Inc
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 2 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+//
+
+#ifndef OPENXT_FIFO_H
+#define OPENXT_FIFO_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/types.h>
+
+///
+/// A ring of audio frames. The playback side uses one as a jitter buffer
+/// between QEMU's packets and the PCM, the capture side to hold what the
+/// PCM had ready until QEMU asks for it. Frames go in and out in whole
+/// frames of frame_size bytes; the peek/reserve calls hand out the
+/// contiguous run at either end so ALSA can read or write in place.
+///
+typedef struct OpenXTFifo {
+
+    char *buffer;
+    int32_t size;
+    int32_t frame_size;
+
+    int32_t head;
+    int32_t fill;
+
+    int64_t dropped;
+
+} OpenXTFifo;
+
+// Settings
+int openxt_fifo_create(OpenXTFifo **fifo, int32_t size, int32_t frame_size);
+int openxt_fifo_destroy(OpenXTFifo *fifo);
+int openxt_fifo_reset(OpenXTFifo *fifo);
+
+// State
+int openxt_fifo_fill(OpenXTFifo *fifo);
+int openxt_fifo_space(OpenXTFifo *fifo);
+
+// Copies
+int openxt_fifo_push(OpenXTFifo *fifo, const void *frames, int32_t num);
+int openxt_fifo_pop(OpenXTFifo *fifo, void *frames, int32_t num);
+
+// In place
+int openxt_fifo_peek(OpenXTFifo *fifo, void **frames);
+int openxt_fifo_consume(OpenXTFifo *fifo, int32_t num);
+int openxt_fifo_reserve(OpenXTFifo *fifo, void **frames);
+int openxt_fifo_commit(OpenXTFifo *fifo, int32_t num);
+
+#endif // OPENXT_FIFO_H
@@ -45,6 +45,7 @@ typedef enum PacketOpCode {
     OPENXT_PLAYBACK_GET_AVAILABLE_ACK   = 31,
     OPENXT_CAPTURE_GET_AVAILABLE        = 32,
     OPENXT_CAPTURE_GET_AVAILABLE_ACK    = 33,
+    OPENXT_PLAYBACK_CREDIT              = 34,
 
     // Control
     OPENXT_PLAYBACK_ENABLE_VOICE        = 40,
@@ -56,14 +57,63 @@ typedef enum PacketOpCode {
     // Process
     OPENXT_PLAYBACK                     = 50,
     OPENXT_CAPTURE                      = 51,
+    OPENXT_PLAYBACK_STREAM              = 52,
     OPENXT_CAPTURE_ACK                  = 53,
+    OPENXT_PLAYBACK_DOORBELL            = 54,
 
 } PacketOpCode;
 
+// Playback init flags. QEMU sets OPENXT_PLAYBACK_FLAG_CREDIT to ask for
+// credit based flow control: instead of asking GET_AVAILABLE before every
+// packet, it sends PLAYBACK_STREAM packets as long as it holds credit, and
+// the helper sends PLAYBACK_CREDIT as the device takes the frames. If the
+// ack does not echo the flag, the helper does not support it.
+#define OPENXT_PLAYBACK_FLAG_CREDIT (1 << 0)
+
+// Init flag for either direction. QEMU sets it to keep the samples in a
+// ring in shared memory, described by the OpenXTShmDesc in the init
+// packet, rather than copying them through V4V. Playback then rings
+// PLAYBACK_DOORBELL after adding frames to the ring, and a CAPTURE_ACK
+// carries no samples, only how many frames the ring holds. If the ack
+// does not echo the flag, the ring could not be mapped and the packets
+// carry the samples as before.
+#define OPENXT_FLAG_SHM (1 << 1)
+
+// How the ring's pages reach us: frames of the stubdomain to map, or, when
+// QEMU runs in dom0 (and for testing), a memfd that we open through /proc,
+// which QEMU must have sealed with F_SEAL_SHRINK.
+// owner is QEMU's pid for a memfd, and ignored for frames: those are only
+// ever mapped from the domain the helper was started for.
+#define OPENXT_SHM_FOREIGN 1
+#define OPENXT_SHM_MEMFD 2
+
+// A header page, then a power of two data pages
+#define OPENXT_SHM_MAX_PAGES (1 + 16)
+
 typedef struct  __attribute__((packed)) {
 
 } OpenBlankPacket;
 
+typedef struct  __attribute__((packed)) {
+
+    int32_t type;
+    int32_t owner;
+    int32_t fd;
+    int32_t npages;
+    uint64_t frames[OPENXT_SHM_MAX_PAGES];
+
+} OpenXTShmDesc;
+
+typedef struct  __attribute__((packed)) {
+
+    int32_t flags;
+    int32_t period;
+
+    // Only read when flags has OPENXT_FLAG_SHM
+    OpenXTShmDesc shm;
+
+} OpenXTPlaybackInitPacket;
+
 typedef struct  __attribute__((packed)) {
 
     int32_t fmt;
@@ -71,6 +121,10 @@ typedef struct  __attribute__((packed)) {
     int32_t valid;
     int32_t nchannels;
 
+    // Only sent back when the init packet had flags
+    int32_t flags;
+    int32_t window;
+
 } OpenXTPlaybackInitAckPacket;
 
 typedef struct  __attribute__((packed)) {
@@ -86,6 +140,22 @@ typedef struct  __attribute__((packed)) {
 
 } OpenXTPlaybackPacket;
 
+typedef struct  __attribute__((packed)) {
+
+    int32_t num_samples;
+    char samples[MAX_PCM_STREAM_BUFFER_SIZE];
+
+} OpenXTPlaybackStreamPacket;
+
+typedef struct  __attribute__((packed)) {
+
+    // Frames of the stream the device has taken since ENABLE_VOICE. QEMU
+    // may have sent up to window frames past this.
+    uint32_t position;
+    int32_t window;
+
+} OpenXTPlaybackCreditPacket;
+
 typedef struct  __attribute__((packed)) {
 
     int32_t vol;
@@ -93,6 +163,13 @@ typedef struct  __attribute__((packed)) {
 
 } OpenXTPlaybackSetVolumePacket;
 
+typedef struct  __attribute__((packed)) {
+
+    int32_t flags;
+    OpenXTShmDesc shm;
+
+} OpenXTCaptureInitPacket;
+
 typedef struct  __attribute__((packed)) {
 
     int32_t fmt;
@@ -100,6 +177,9 @@ typedef struct  __attribute__((packed)) {
     int32_t valid;
     int32_t nchannels;
 
+    // Only sent back when the init packet had flags
+    int32_t flags;
+
 } OpenXTCaptureInitAckPacket;
 
 typedef struct  __attribute__((packed)) {
@@ -122,6 +202,10 @@ typedef struct  __attribute__((packed)) {
 } OpenXTCaptureAckPacket;
 
 #define PLAYBACK_PACKET_LENGTH(a) (sizeof(int32_t) + (sizeof(uint32_t) * a))
+#define PLAYBACK_INIT_ACK_PACKET_LENGTH(flags) \
+    ((flags) ? sizeof(OpenXTPlaybackInitAckPacket) : (sizeof(int32_t) * 4))
+#define CAPTURE_INIT_ACK_PACKET_LENGTH(flags) \
+    ((flags) ? sizeof(OpenXTCaptureInitAckPacket) : (sizeof(int32_t) * 4))
 #define CAPTURE_ACK_PACKET_LENGTH(a) (sizeof(int32_t) + (sizeof(uint32_t) * a))
 
 #endif // OPENXT_PACKETS_H
@@ -30,8 +30,12 @@
 // The following means that we should have room for roughly 1280 samples
 #define MAX_PCM_BUFFER_SIZE (4096)
 
+// Room for a PLAYBACK_STREAM packet, which carries several periods (3072
+// samples) at once when QEMU uses credit based flow control
+#define MAX_PCM_STREAM_BUFFER_SIZE (4096 * 3)
+
 // Define the maximum size of a V4V packet
-#define V4V_MAX_PACKET_BODY_SIZE (4096 * 2)
+#define V4V_MAX_PACKET_BODY_SIZE (4096 * 4)
 
 // The following is the V4V port that we will use for communications.
 #define OPENXT_AUDIO_PORT 5001
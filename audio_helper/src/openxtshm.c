@@ -0,0 +1,382 @@
+//
+// Copyright (c) 2015 Assured Information Security, Inc
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 2 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+//
+
+#define _GNU_SOURCE
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "openxtshm.h"
+#include "openxtdebug.h"
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Settings Functions                                                                                  //
+/////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+static int openxt_shm_map_foreign(OpenXTShm *shm, OpenXTShmDesc *desc, int32_t domid)
+{
+    int i;
+    xen_pfn_t frames[OPENXT_SHM_MAX_PAGES];
+
+    shm->xch = xc_interface_open(NULL, NULL, 0);
+    openxt_checkp(shm->xch, -ENODEV);
+
+    for (i = 0; i < desc->npages; i++)
+        frames[i] = desc->frames[i];
+
+    // The pages belong to the stubdomain, which gave us their frame numbers.
+    // Whatever QEMU put in owner, they are only ever mapped from there.
+    shm->base = xc_map_foreign_pages(shm->xch, domid, PROT_READ | PROT_WRITE,
+                                     frames, desc->npages);
+    openxt_assert_ret(shm->base != NULL, errno, -errno);
+
+    return 0;
+}
+
+static int openxt_shm_map_memfd(OpenXTShm *shm, OpenXTShmDesc *desc, int32_t domid)
+{
+    int fd;
+    int seals;
+    ssize_t len;
+    void *base;
+    char path[64];
+    char target[64];
+    struct stat st;
+
+    // Only QEMU in dom0 can hand us a memfd. A stubdomain naming a process
+    // here would have us open any file that process holds.
+    openxt_assert(domid == 0, -EPERM);
+
+    // QEMU is a process in this domain, so we can open its memfd directly
+    snprintf(path, sizeof(path), "/proc/%d/fd/%d", desc->owner, desc->fd);
+
+    fd = open(path, O_RDWR);
+    openxt_assert_ret(fd >= 0, errno, -errno);
+
+    // Make sure that what we opened really is a memfd, and not some other
+    // file that the process has open
+    snprintf(path, sizeof(path), "/proc/self/fd/%d", fd);
+    len = readlink(path, target, sizeof(target) - 1);
+    if (len >= 0)
+        target[len] = '\0';
+    if (len < 0 || strncmp(target, "/memfd:", strlen("/memfd:")) != 0) {
+        close(fd);
+        return -EINVAL;
+    }
+
+    // QEMU could shrink an unsealed memfd under us after the size check,
+    // and we would die of SIGBUS on the next access to the ring
+    seals = fcntl(fd, F_GET_SEALS);
+    if (seals < 0 || (seals & F_SEAL_SHRINK) == 0) {
+        close(fd);
+        return -EPERM;
+    }
+
+    // A file shorter than the mapping would fault when we touch the end
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) ||
+        st.st_size < (off_t)desc->npages * OPENXT_SHM_PAGE_SIZE) {
+        close(fd);
+        return -EINVAL;
+    }
+
+    base = mmap(NULL, (size_t)desc->npages * OPENXT_SHM_PAGE_SIZE,
+                PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    openxt_assert_ret(base != MAP_FAILED, errno, -errno);
+
+    shm->base = base;
+    return 0;
+}
+
+///
+/// Map a ring that QEMU has described in an init packet, and lay it out.
+///
+/// @param shm pointer to the ring to be mapped
+/// @param desc the description of the ring from QEMU
+/// @param frame_size the size of one frame in bytes
+/// @param domid the domain QEMU runs in, which the pages must come from
+/// @return -EINVAL shm == NULL
+///         -EINVAL *shm != NULL
+///         -EINVAL desc == NULL
+///         -EINVAL the ring is not a header page and data pages that
+///                 hold a power of two frames
+///         -EINVAL unknown type, or a memfd that is not one
+///         -EPERM a memfd from outside dom0, or not sealed against
+///                shrinking
+///         -ENOMEM if out of memory
+///         negative error code if the pages cannot be mapped
+///         0 on success
+///
+int openxt_shm_map(OpenXTShm **shm, OpenXTShmDesc *desc, int32_t frame_size, int32_t domid)
+{
+    int ret;
+    int32_t data_pages;
+    uint32_t size;
+
+    // Sanity checks
+    openxt_checkp(shm, -EINVAL);
+    openxt_assert(*shm == NULL, -EINVAL);
+    openxt_checkp(desc, -EINVAL);
+    openxt_assert(frame_size > 0, -EINVAL);
+    openxt_assert(desc->npages >= 2 && desc->npages <= OPENXT_SHM_MAX_PAGES, -EINVAL);
+
+    // The ring must hold a power of two frames, so that the free running
+    // positions stay in step with it when they wrap.
+    data_pages = desc->npages - 1;
+    size = data_pages * (OPENXT_SHM_PAGE_SIZE / frame_size);
+    openxt_assert((OPENXT_SHM_PAGE_SIZE % frame_size) == 0, -EINVAL);
+    openxt_assert(size > 0 && (size & (size - 1)) == 0, -EINVAL);
+
+    *shm = (OpenXTShm *)calloc(1, sizeof(OpenXTShm));
+    if (*shm == NULL)
+        return -ENOMEM;
+
+    switch (desc->type) {
+
+        case OPENXT_SHM_FOREIGN:
+            ret = openxt_shm_map_foreign(*shm, desc, domid);
+            break;
+
+        case OPENXT_SHM_MEMFD:
+            ret = openxt_shm_map_memfd(*shm, desc, domid);
+            break;
+
+        default:
+            ret = -EINVAL;
+            break;
+    }
+
+    if (ret != 0) {
+        openxt_shm_unmap(*shm);
+        *shm = NULL;
+        return ret;
+    }
+
+    (*shm)->npages = desc->npages;
+    (*shm)->header = (OpenXTShmHeader *)(*shm)->base;
+    (*shm)->data = (char *)(*shm)->base + OPENXT_SHM_PAGE_SIZE;
+    (*shm)->size = size;
+    (*shm)->frame_size = frame_size;
+
+    // Lay out the header. QEMU does not touch the ring until it has the ack.
+    (*shm)->header->frame_size = frame_size;
+    (*shm)->header->size = (*shm)->size;
+    openxt_shm_reset(*shm);
+    __atomic_store_n(&(*shm)->header->magic, OPENXT_SHM_MAGIC, __ATOMIC_RELEASE);
+
+    // Done
+    return 0;
+}
+
+///
+/// Unmap a ring that we previously mapped.
+///
+/// @param shm a pointer to the ring
+/// @return 0 on success, or if the ring is already NULL
+///
+int openxt_shm_unmap(OpenXTShm *shm)
+{
+    // Ignore if the ring is already unmapped
+    if (shm == NULL)
+        return 0;
+
+    if (shm->base != NULL)
+        munmap(shm->base, (size_t)shm->npages * OPENXT_SHM_PAGE_SIZE);
+
+    if (shm->xch != NULL)
+        xc_interface_close(shm->xch);
+
+    // Cleanup memory
+    free(shm);
+
+    // Done
+    return 0;
+}
+
+///
+/// Empty the ring, as when a stream is stopped. QEMU must not be using it.
+///
+/// @param shm a pointer to the ring
+/// @return -EINVAL shm == NULL
+///         0 on success
+///
+int openxt_shm_reset(OpenXTShm *shm)
+{
+    // Sanity checks
+    openxt_checkp(shm, -EINVAL);
+
+    __atomic_store_n(&shm->header->write, 0, __ATOMIC_RELEASE);
+    __atomic_store_n(&shm->header->read, 0, __ATOMIC_RELEASE);
+
+    // Done
+    return 0;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////
+// State Functions                                                                                     //
+/////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+///
+/// @param shm a pointer to the ring
+/// @return -EINVAL shm == NULL
+///         the number of frames in the ring on success, never more than
+///         the ring holds whatever QEMU has written to the header
+///
+int openxt_shm_fill(OpenXTShm *shm)
+{
+    uint32_t fill;
+
+    // Sanity checks
+    openxt_checkp(shm, -EINVAL);
+
+    fill = __atomic_load_n(&shm->header->write, __ATOMIC_ACQUIRE) -
+           __atomic_load_n(&shm->header->read, __ATOMIC_ACQUIRE);
+
+    if (fill > shm->size)
+        fill = shm->size;
+
+    return fill;
+}
+
+///
+/// @param shm a pointer to the ring
+/// @return -EINVAL shm == NULL
+///         the number of free frames in the ring on success
+///
+int openxt_shm_space(OpenXTShm *shm)
+{
+    // Sanity checks
+    openxt_checkp(shm, -EINVAL);
+
+    return shm->size - openxt_shm_fill(shm);
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Consumer Functions                                                                                  //
+/////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+///
+/// Get the frames at the read position that can be used without wrapping.
+///
+/// @param shm a pointer to the ring
+/// @param frames set to the first frame at the read position
+/// @return -EINVAL shm == NULL
+///         -EINVAL frames == NULL
+///         the number of contiguous frames on success
+///
+int openxt_shm_peek(OpenXTShm *shm, void **frames)
+{
+    uint32_t read;
+    uint32_t fill;
+
+    // Sanity checks
+    openxt_checkp(shm, -EINVAL);
+    openxt_checkp(frames, -EINVAL);
+
+    fill = openxt_shm_fill(shm);
+    read = __atomic_load_n(&shm->header->read, __ATOMIC_RELAXED) & (shm->size - 1);
+
+    *frames = shm->data + (size_t)read * shm->frame_size;
+
+    if (read + fill > shm->size)
+        return shm->size - read;
+
+    return fill;
+}
+
+///
+/// Hand frames at the read position back to the producer.
+///
+/// @param shm a pointer to the ring
+/// @param num the number of frames
+/// @return -EINVAL shm == NULL
+///         -EINVAL num < 0 or num > the frames in the ring
+///         0 on success
+///
+int openxt_shm_consume(OpenXTShm *shm, int32_t num)
+{
+    // Sanity checks
+    openxt_checkp(shm, -EINVAL);
+    openxt_assert(num >= 0 && num <= openxt_shm_fill(shm), -EINVAL);
+
+    __atomic_store_n(&shm->header->read,
+                     __atomic_load_n(&shm->header->read, __ATOMIC_RELAXED) + num,
+                     __ATOMIC_RELEASE);
+
+    // Done
+    return 0;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Producer Functions                                                                                  //
+/////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+///
+/// Get the free frames at the write position that can be filled without
+/// wrapping.
+///
+/// @param shm a pointer to the ring
+/// @param frames set to the first free frame
+/// @return -EINVAL shm == NULL
+///         -EINVAL frames == NULL
+///         the number of contiguous free frames on success
+///
+int openxt_shm_reserve(OpenXTShm *shm, void **frames)
+{
+    uint32_t write;
+    uint32_t space;
+
+    // Sanity checks
+    openxt_checkp(shm, -EINVAL);
+    openxt_checkp(frames, -EINVAL);
+
+    space = openxt_shm_space(shm);
+    write = __atomic_load_n(&shm->header->write, __ATOMIC_RELAXED) & (shm->size - 1);
+
+    *frames = shm->data + (size_t)write * shm->frame_size;
+
+    if (write + space > shm->size)
+        return shm->size - write;
+
+    return space;
+}
+
+///
+/// Publish frames that were filled in at the write position.
+///
+/// @param shm a pointer to the ring
+/// @param num the number of frames
+/// @return -EINVAL shm == NULL
+///         -EINVAL num < 0 or num > the free frames
+///         0 on success
+///
+int openxt_shm_commit(OpenXTShm *shm, int32_t num)
+{
+    // Sanity checks
+    openxt_checkp(shm, -EINVAL);
+    openxt_assert(num >= 0 && num <= openxt_shm_space(shm), -EINVAL);
+
+    __atomic_store_n(&shm->header->write,
+                     __atomic_load_n(&shm->header->write, __ATOMIC_RELAXED) + num,
+                     __ATOMIC_RELEASE);
+
+    // Done
+    return 0;
+}
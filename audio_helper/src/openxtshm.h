@@ -0,0 +1,84 @@
+//
+// Copyright (c) 2015 Assured Information Security, Inc
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 2 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+//
+
+
+#ifndef OPENXT_SHM_H
+#define OPENXT_SHM_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/types.h>
+#include <xenctrl.h>
+
+#include "openxtpackets.h"
+
+#define OPENXT_SHM_PAGE_SIZE 4096
+#define OPENXT_SHM_MAGIC 0x4f585452
+
+///
+/// The first page of a ring. We fill in the layout when we map it, and
+/// QEMU waits for the init ack before using it. Positions are free running
+/// frame counts: the producer only ever stores write, the consumer read,
+/// each on its own cache line.
+///
+typedef struct OpenXTShmHeader {
+
+    uint32_t magic;
+    uint32_t frame_size;
+    uint32_t size;
+
+    uint32_t write __attribute__((aligned(64)));
+    uint32_t read __attribute__((aligned(64)));
+
+} OpenXTShmHeader;
+
+///
+/// Our side of a mapped ring. The header is shared with QEMU, which we do
+/// not trust, so the size is ours and fill levels are clamped to it.
+///
+typedef struct OpenXTShm {
+
+    void *base;
+    int32_t npages;
+    xc_interface *xch;
+
+    OpenXTShmHeader *header;
+    char *data;
+    uint32_t size;
+    int32_t frame_size;
+
+} OpenXTShm;
+
+// Settings
+int openxt_shm_map(OpenXTShm **shm, OpenXTShmDesc *desc, int32_t frame_size, int32_t domid);
+int openxt_shm_unmap(OpenXTShm *shm);
+int openxt_shm_reset(OpenXTShm *shm);
+
+// State
+int openxt_shm_fill(OpenXTShm *shm);
+int openxt_shm_space(OpenXTShm *shm);
+
+// Consumer
+int openxt_shm_peek(OpenXTShm *shm, void **frames);
+int openxt_shm_consume(OpenXTShm *shm, int32_t num);
+
+// Producer
+int openxt_shm_reserve(OpenXTShm *shm, void **frames);
+int openxt_shm_commit(OpenXTShm *shm, int32_t num);
+
+#endif // OPENXT_SHM_H
@@ -20,8 +20,12 @@
 // Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
 //
 
+#include <stddef.h>
+
 #include "openxtv4v.h"
 #include "openxtalsa.h"
+#include "openxtfifo.h"
+#include "openxtshm.h"
 #include "openxtdebug.h"
 #include "openxtpackets.h"
 #include "openxtvmaudio.h"
@@ -33,6 +37,44 @@
 Settings *playback_settings = NULL;
 Settings *capture_settings = NULL;
 
+// Frames per packet, and how many packets of each the FIFOs hold. The
+// playback FIFO is the jitter buffer: QEMU only sends what GET_AVAILABLE
+// said the device had room for, so it normally holds at most a packet or
+// two while the device catches up. The capture FIFO holds what the device
+// had ready before QEMU asked for it.
+#define OPENXT_PACKET_FRAMES ((int)(MAX_PCM_BUFFER_SIZE / sizeof(uint32_t)))
+#define OPENXT_STREAM_PACKET_FRAMES ((int)(MAX_PCM_STREAM_BUFFER_SIZE / sizeof(uint32_t)))
+#define OPENXT_PLAYBACK_FIFO_PACKETS 16
+#define OPENXT_CAPTURE_FIFO_PACKETS 4
+
+// The V4V socket plus both PCMs' descriptors
+#define OPENXT_MAX_POLLFDS 16
+
+OpenXTFifo *playback_fifo = NULL;
+OpenXTFifo *capture_fifo = NULL;
+
+bool capture_enabled = false;
+
+// Shared memory rings (OPENXT_FLAG_SHM). When QEMU has set one up, it
+// takes the place of the FIFO for that direction: QEMU writes playback
+// frames straight into it, and capture frames are read straight out of it.
+OpenXTShm *playback_shm = NULL;
+OpenXTShm *capture_shm = NULL;
+
+// Credit based flow control (OPENXT_PLAYBACK_FLAG_CREDIT). The window is
+// how far QEMU may run ahead of the device, in frames; a credit packet goes
+// out each time the device has taken half of it, so QEMU never stalls.
+#define OPENXT_CREDIT_PERIODS 2
+
+bool playback_credit = false;
+int32_t playback_window = 0;
+uint32_t playback_position = 0;
+uint32_t playback_granted = 0;
+
+// The domain QEMU runs in, from the command line: our only V4V peer, and
+// the only domain whose pages we map for a shared ring.
+int32_t stubdomid = 0;
+
 // Global V4V Packets
 V4VPacket snd_packet;
 V4VPacket rcv_packet;
@@ -42,13 +84,17 @@ V4VConnection *conn = NULL;
 
 // Global V4V Packet Playback Bodies
 OpenXTPlaybackPacket *playback_packet = NULL;
+OpenXTPlaybackInitPacket *playback_init_packet = NULL;
 OpenXTPlaybackInitAckPacket *playback_init_ack_packet = NULL;
+OpenXTPlaybackStreamPacket *playback_stream_packet = NULL;
+OpenXTPlaybackCreditPacket *playback_credit_packet = NULL;
 OpenXTPlaybackSetVolumePacket *playback_set_volume_packet = NULL;
 OpenXTPlaybackGetAvailableAckPacket *playback_get_available_ack_packet = NULL;
 
 // Global V4V Packet Capture Bodies
 OpenXTCapturePacket *capture_packet = NULL;
 OpenXTCaptureAckPacket *capture_ack_packet = NULL;
+OpenXTCaptureInitPacket *capture_init_packet = NULL;
 OpenXTCaptureInitAckPacket *capture_init_ack_packet = NULL;
 OpenXTCaptureGetAvailableAckPacket *capture_get_available_ack_packet = NULL;
 
@@ -57,27 +103,147 @@ OpenXTCaptureGetAvailableAckPacket *capture_get_available_ack_packet = NULL;
 /////////////////////////////////////////////////////////////////////////////////////////////////////////
 
 ///
+/// Tell QEMU how far the device has got, so that it may send up to the
+/// window past it. Nothing is sent unless QEMU asked for credits, nor
+/// until the device has taken half the window since the last credit.
 ///
+/// @param force send even if less than half the window has been taken,
+///        to hand QEMU a full window when the stream starts
+/// @return negative error code if the packet cannot be set up, or the
+///         send fails or is short
+///         0 on success, or if there was nothing to send
 ///
-/// @param
-/// @return -EINVAL
-///         -EINVAL
-///         negative error code on failure
-///         0 on success
-///
-static int openxt_process_playback(void)
+static int openxt_playback_send_credit(bool force)
 {
     int ret;
 
-    ret = openxt_alsa_writei(playback_settings,
-                             playback_packet->samples,
-                             playback_packet->num_samples,
-                             MAX_PCM_BUFFER_SIZE);
-    openxt_assert_ret(ret == playback_packet->num_samples, ret, -EPIPE);
+    // Nothing to do unless QEMU asked for credits, and it is not worth a
+    // packet until the device has taken half the window.
+    if (playback_credit == false)
+        return 0;
+    if (force == false && playback_position - playback_granted < (uint32_t)(playback_window / 2))
+        return 0;
+
+    // Setup the packet.
+    ret = openxt_v4v_set_opcode(&snd_packet, OPENXT_PLAYBACK_CREDIT);
+    openxt_assert_ret(ret == 0, ret, ret);
+    ret = openxt_v4v_set_length(&snd_packet, sizeof(OpenXTPlaybackCreditPacket));
+    openxt_assert_ret(ret == 0, ret, ret);
+
+    playback_credit_packet->position = playback_position;
+    playback_credit_packet->window = playback_window;
 
+    // Send the packet.
+    ret = openxt_v4v_send(conn, &snd_packet);
+    openxt_assert_ret(ret == sizeof(OpenXTPlaybackCreditPacket), ret, ret);
+
+    playback_granted = playback_position;
+
+    // Success
     return 0;
 }
 
+static int openxt_playback_pending(void)
+{
+    if (playback_shm != NULL)
+        return openxt_shm_fill(playback_shm);
+
+    return openxt_fifo_fill(playback_fifo);
+}
+
+static int openxt_playback_peek(void **frames)
+{
+    if (playback_shm != NULL)
+        return openxt_shm_peek(playback_shm, frames);
+
+    return openxt_fifo_peek(playback_fifo, frames);
+}
+
+static int openxt_playback_consume(int32_t num)
+{
+    if (playback_shm != NULL)
+        return openxt_shm_consume(playback_shm, num);
+
+    return openxt_fifo_consume(playback_fifo, num);
+}
+
+int openxt_playback_drain(void)
+{
+    int ret;
+    int num;
+    void *frames;
+
+    // Write as much of the jitter buffer (or the shared ring) as the
+    // device will take without blocking. It wraps, so this can take two
+    // writes.
+    while ((num = openxt_playback_peek(&frames)) > 0) {
+
+        ret = openxt_alsa_writei(playback_settings,
+                                 frames,
+                                 num,
+                                 num * playback_settings->sample_size);
+        openxt_assert_ret(ret >= 0, ret, ret);
+
+        if (ret == 0)
+            break;
+
+        playback_position += ret;
+
+        ret = openxt_playback_consume(ret);
+        openxt_assert_ret(ret == 0, ret, ret);
+    }
+
+    return openxt_playback_send_credit(false);
+}
+
+int openxt_playback_queue(void *samples, int32_t num)
+{
+    int ret;
+
+    // Queue the packet, and hand what we can to the device straight away.
+    // Anything that does not fit has arrived faster than the device plays,
+    // and is dropped rather than letting the latency grow. Dropped frames
+    // still count as taken, so that QEMU's credits stay in step with ours.
+    ret = openxt_fifo_push(playback_fifo, samples, num);
+    openxt_assert_ret(ret >= 0, ret, ret);
+
+    if (ret < num) {
+        openxt_warn("playback jitter buffer full, dropped %d frames\n", num - ret);
+        playback_position += num - ret;
+    }
+
+    return openxt_playback_drain();
+}
+
+static int openxt_process_playback(void)
+{
+    openxt_assert(playback_shm == NULL, -EINVAL);
+    openxt_assert(playback_packet->num_samples >= 0, -EINVAL);
+    openxt_assert(playback_packet->num_samples <= OPENXT_PACKET_FRAMES, -EINVAL);
+
+    return openxt_playback_queue(playback_packet->samples,
+                                 playback_packet->num_samples);
+}
+
+static int openxt_process_playback_stream(void)
+{
+    openxt_assert(playback_shm == NULL, -EINVAL);
+    openxt_assert(playback_credit == true, -EINVAL);
+    openxt_assert(playback_stream_packet->num_samples >= 0, -EINVAL);
+    openxt_assert(playback_stream_packet->num_samples <= OPENXT_STREAM_PACKET_FRAMES, -EINVAL);
+
+    return openxt_playback_queue(playback_stream_packet->samples,
+                                 playback_stream_packet->num_samples);
+}
+
+static int openxt_process_playback_doorbell(void)
+{
+    // QEMU has added frames to the shared ring
+    openxt_assert(playback_shm != NULL, -EINVAL);
+
+    return openxt_playback_drain();
+}
+
 ///
 ///
 ///
@@ -91,6 +257,47 @@ static int openxt_process_playback_init(void)
 {
     int ret;
     int valid = 1;
+    int32_t flags = 0;
+    int32_t requested = 0;
+    int32_t period = 0;
+    int32_t length;
+    int32_t size;
+
+    // Older versions of QEMU send an empty init packet, and know nothing
+    // of flags. Newer ones may ask for credit based flow control, giving
+    // the number of frames they intend to send at a time, and for a
+    // shared ring, which needs the whole packet.
+    length = openxt_v4v_get_length(&rcv_packet);
+    if (length >= (int32_t)offsetof(OpenXTPlaybackInitPacket, shm)) {
+        requested = playback_init_packet->flags;
+        period = playback_init_packet->period;
+    }
+    if (length < (int32_t)sizeof(OpenXTPlaybackInitPacket))
+        requested &= ~OPENXT_FLAG_SHM;
+
+    if (period <= 0 || period > OPENXT_STREAM_PACKET_FRAMES)
+        period = OPENXT_STREAM_PACKET_FRAMES;
+
+    // Map the ring, if asked to. If we cannot, the ack says so, and QEMU
+    // goes back to sending the samples in packets.
+    openxt_shm_unmap(playback_shm);
+    playback_shm = NULL;
+
+    if ((requested & OPENXT_FLAG_SHM) != 0) {
+        ret = openxt_shm_map(&playback_shm, &playback_init_packet->shm, playback_settings->sample_size, stubdomid);
+        if (ret == 0)
+            flags |= OPENXT_FLAG_SHM;
+        else
+            openxt_warn("failed to map the playback ring: %d\n", ret);
+    }
+
+    flags |= requested & OPENXT_PLAYBACK_FLAG_CREDIT;
+    size = (playback_shm != NULL) ? (int32_t)playback_shm->size : playback_fifo->size;
+
+    playback_credit = (flags & OPENXT_PLAYBACK_FLAG_CREDIT) != 0;
+    playback_window = min(OPENXT_CREDIT_PERIODS * period, size);
+    playback_position = 0;
+    playback_granted = 0;
 
     // Set the valid bit
     valid &= (openxt_alsa_init(playback_settings) == 0) ? 1 : 0;
@@ -102,7 +309,8 @@ static int openxt_process_playback_init(void)
     // Setup the ack packet
     ret = openxt_v4v_set_opcode(&snd_packet, OPENXT_PLAYBACK_INIT_ACK);
     openxt_assert_ret(ret == 0, ret, ret);
-    ret = openxt_v4v_set_length(&snd_packet, sizeof(OpenXTPlaybackInitAckPacket));
+    length = PLAYBACK_INIT_ACK_PACKET_LENGTH(requested);
+    ret = openxt_v4v_set_length(&snd_packet, length);
     openxt_assert_ret(ret == 0, ret, ret);
 
     // Setup the ack body that will be sent back to QEMU. Specifically we need to
@@ -112,10 +320,12 @@ static int openxt_process_playback_init(void)
     playback_init_ack_packet->freq = playback_settings->freq;
     playback_init_ack_packet->valid = playback_settings->valid;
     playback_init_ack_packet->nchannels = playback_settings->nchannels;
+    playback_init_ack_packet->flags = flags;
+    playback_init_ack_packet->window = playback_window;
 
     // Send the ack.
     ret = openxt_v4v_send(conn, &snd_packet);
-    openxt_assert_ret(ret == sizeof(OpenXTPlaybackInitAckPacket), ret, ret);
+    openxt_assert_ret(ret == length, ret, ret);
 
     // Success
     return 0;
@@ -123,6 +333,10 @@ static int openxt_process_playback_init(void)
 
 static int openxt_process_playback_fini(void)
 {
+    openxt_fifo_reset(playback_fifo);
+    openxt_shm_unmap(playback_shm);
+    playback_shm = NULL;
+
     openxt_alsa_mixer_fini(playback_settings);
     openxt_alsa_fini(playback_settings);
 
@@ -151,9 +365,20 @@ static int openxt_process_playback_enable_voice(void)
 {
     int ret;
 
+    openxt_fifo_reset(playback_fifo);
+    if (playback_shm != NULL)
+        openxt_shm_reset(playback_shm);
+
     ret = openxt_alsa_prepare(playback_settings);
     openxt_assert_ret(ret == 0, ret, ret);
 
+    // The stream starts over, and QEMU gets a full window to start it with.
+    playback_position = 0;
+    playback_granted = 0;
+
+    ret = openxt_playback_send_credit(true);
+    openxt_assert_ret(ret == 0, ret, ret);
+
     return 0;
 }
 
@@ -161,6 +386,10 @@ static int openxt_process_playback_disable_voice(void)
 {
     int ret;
 
+    openxt_fifo_reset(playback_fifo);
+    if (playback_shm != NULL)
+        openxt_shm_reset(playback_shm);
+
     ret = openxt_alsa_drop(playback_settings);
     openxt_assert_ret(ret == 0, ret, ret);
 
@@ -170,6 +399,7 @@ static int openxt_process_playback_disable_voice(void)
 static int openxt_process_playback_get_available(void)
 {
     int ret;
+    int available;
 
     // Setup the packet.
     ret = openxt_v4v_set_opcode(&snd_packet, OPENXT_PLAYBACK_GET_AVAILABLE_ACK);
@@ -177,8 +407,14 @@ static int openxt_process_playback_get_available(void)
     ret = openxt_v4v_set_length(&snd_packet, sizeof(OpenXTPlaybackGetAvailableAckPacket));
     openxt_assert_ret(ret == 0, ret, ret);
 
-    // Fill in the packet's contents.
-    playback_get_available_ack_packet->available = openxt_alsa_get_available(playback_settings);
+    // Fill in the packet's contents. What is still queued in the jitter
+    // buffer is owed to the device already, so it does not count as room.
+    // With a shared ring, QEMU cannot write more than the ring holds.
+    available = openxt_alsa_get_available(playback_settings);
+    available -= openxt_playback_pending();
+    if (playback_shm != NULL)
+        available = min(available, openxt_shm_space(playback_shm));
+    playback_get_available_ack_packet->available = max(available, 0);
 
     // Send the packet.
     ret = openxt_v4v_send(conn, &snd_packet);
@@ -189,19 +425,103 @@ static int openxt_process_playback_get_available(void)
 }
 
 /////////////////////////////////////////////////////////////////////////////////////////////////////////
-// Playback Functions                                                                                  //
+// Capture Functions                                                                                   //
 /////////////////////////////////////////////////////////////////////////////////////////////////////////
 
+static int openxt_capture_reserve(void **frames)
+{
+    if (capture_shm != NULL)
+        return openxt_shm_reserve(capture_shm, frames);
+
+    return openxt_fifo_reserve(capture_fifo, frames);
+}
+
+static int openxt_capture_commit(int32_t num)
+{
+    if (capture_shm != NULL)
+        return openxt_shm_commit(capture_shm, num);
+
+    return openxt_fifo_commit(capture_fifo, num);
+}
+
+int openxt_capture_fill(void)
+{
+    int ret;
+    int num;
+    void *frames;
+
+    // If QEMU has fallen behind, make room by dropping the oldest packet's
+    // worth, so that what it gets next is as recent as we can make it.
+    // The read position of a shared ring is QEMU's, so there we leave it
+    // to the device to overrun instead.
+    if (capture_shm == NULL && openxt_fifo_space(capture_fifo) == 0) {
+        num = min(openxt_fifo_fill(capture_fifo), OPENXT_PACKET_FRAMES);
+        openxt_fifo_consume(capture_fifo, num);
+        capture_fifo->dropped += num;
+    }
+
+    // Read whatever the device has ready, without blocking.
+    while ((num = openxt_capture_reserve(&frames)) > 0) {
+
+        ret = openxt_alsa_readi(capture_settings,
+                                frames,
+                                num,
+                                num * capture_settings->sample_size);
+        openxt_assert_ret(ret >= 0, ret, ret);
+
+        if (ret == 0)
+            break;
+
+        ret = openxt_capture_commit(ret);
+        openxt_assert_ret(ret == 0, ret, ret);
+    }
+
+    return 0;
+}
+
+///
+/// Whether to wait on the capture PCM. The FIFO always makes room for what
+/// the device has, but a full shared ring has nowhere to put it, and a PCM
+/// left ready (or overrun) would wake us up in a loop until QEMU reads.
+///
+/// @return true if the capture PCM's descriptors belong in the poll set
+///
+bool openxt_capture_pollable(void)
+{
+    if (capture_enabled == false)
+        return false;
+
+    if (capture_shm != NULL)
+        return openxt_shm_space(capture_shm) > 0;
+
+    return true;
+}
+
 static int openxt_process_capture(void)
 {
     int ret;
     int nread;
+    int num_samples;
+
+    openxt_assert(capture_packet->num_samples >= 0, -EINVAL);
+    openxt_assert(capture_packet->num_samples <= OPENXT_PACKET_FRAMES, -EINVAL);
 
-    // Fill in the packet with the samples from the sound card.
-    nread = openxt_alsa_readi(capture_settings,
-                              capture_ack_packet->samples,
-                              capture_packet->num_samples,
-                              MAX_PCM_BUFFER_SIZE);
+    // Top up with anything that came in since the last poll, then fill in
+    // the packet with the oldest samples we have.
+    ret = openxt_capture_fill();
+    openxt_assert_ret(ret == 0, ret, ret);
+
+    // With a shared ring the samples are already where QEMU can read
+    // them, and the ack only says how many there are.
+    if (capture_shm != NULL) {
+        num_samples = openxt_shm_fill(capture_shm);
+        nread = 0;
+    } else {
+        nread = openxt_fifo_pop(capture_fifo,
+                                capture_ack_packet->samples,
+                                capture_packet->num_samples);
+        num_samples = nread;
+    }
     openxt_assert_ret(nread >= 0, nread, nread);
 
     // Setup the packet.
@@ -210,7 +530,7 @@ static int openxt_process_capture(void)
     ret = openxt_v4v_set_length(&snd_packet, CAPTURE_ACK_PACKET_LENGTH(nread));
     openxt_assert_ret(ret == 0, ret, ret);
 
-    capture_ack_packet->num_samples = nread;
+    capture_ack_packet->num_samples = num_samples;
 
     // Send the packet.
     ret = openxt_v4v_send(conn, &snd_packet);
@@ -224,6 +544,25 @@ static int openxt_process_capture_init(void)
 {
     int ret;
     int valid = 1;
+    int32_t flags = 0;
+    int32_t requested = 0;
+    int32_t length;
+
+    // As for playback, older versions of QEMU send an empty init packet.
+    length = openxt_v4v_get_length(&rcv_packet);
+    if (length >= (int32_t)sizeof(OpenXTCaptureInitPacket))
+        requested = capture_init_packet->flags & OPENXT_FLAG_SHM;
+
+    openxt_shm_unmap(capture_shm);
+    capture_shm = NULL;
+
+    if ((requested & OPENXT_FLAG_SHM) != 0) {
+        ret = openxt_shm_map(&capture_shm, &capture_init_packet->shm, capture_settings->sample_size, stubdomid);
+        if (ret == 0)
+            flags |= OPENXT_FLAG_SHM;
+        else
+            openxt_warn("failed to map the capture ring: %d\n", ret);
+    }
 
     // Set the valid bit
     valid &= (openxt_alsa_init(capture_settings) == 0) ? 1 : 0;
@@ -234,7 +573,8 @@ static int openxt_process_capture_init(void)
     // Setup the ack packet
     ret = openxt_v4v_set_opcode(&snd_packet, OPENXT_CAPTURE_INIT_ACK);
     openxt_assert_ret(ret == 0, ret, ret);
-    ret = openxt_v4v_set_length(&snd_packet, sizeof(OpenXTCaptureInitAckPacket));
+    length = CAPTURE_INIT_ACK_PACKET_LENGTH(requested);
+    ret = openxt_v4v_set_length(&snd_packet, length);
     openxt_assert_ret(ret == 0, ret, ret);
 
     // Setup the ack body that will be sent back to QEMU. Specifically we need to
@@ -244,10 +584,11 @@ static int openxt_process_capture_init(void)
     capture_init_ack_packet->freq = capture_settings->freq;
     capture_init_ack_packet->valid = capture_settings->valid;
     capture_init_ack_packet->nchannels = capture_settings->nchannels;
+    capture_init_ack_packet->flags = flags;
 
     // Send the ack.
     ret = openxt_v4v_send(conn, &snd_packet);
-    openxt_assert_ret(ret == sizeof(OpenXTCaptureInitAckPacket), ret, ret);
+    openxt_assert_ret(ret == length, ret, ret);
 
     // Success
     return 0;
@@ -255,6 +596,11 @@ static int openxt_process_capture_init(void)
 
 static int openxt_process_capture_fini(void)
 {
+    capture_enabled = false;
+    openxt_fifo_reset(capture_fifo);
+    openxt_shm_unmap(capture_shm);
+    capture_shm = NULL;
+
     openxt_alsa_fini(capture_settings);
 
     // No validation code on fini. If there is an error there really isn't
@@ -268,11 +614,17 @@ static int openxt_process_capture_enable_voice(void)
 {
     int ret;
 
+    openxt_fifo_reset(capture_fifo);
+    if (capture_shm != NULL)
+        openxt_shm_reset(capture_shm);
+
     ret = openxt_alsa_prepare(capture_settings);
     openxt_assert_ret(ret == 0, ret, ret);
     ret = openxt_alsa_start(capture_settings);
     openxt_assert_ret(ret == 0, ret, ret);
 
+    capture_enabled = true;
+
     return 0;
 }
 
@@ -280,12 +632,141 @@ static int openxt_process_capture_disable_voice(void)
 {
     int ret;
 
+    capture_enabled = false;
+    openxt_fifo_reset(capture_fifo);
+    if (capture_shm != NULL)
+        openxt_shm_reset(capture_shm);
+
     ret = openxt_alsa_drop(capture_settings);
     openxt_assert_ret(ret == 0, ret, ret);
 
     return 0;
 }
 
+/////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Event Loop                                                                                          //
+/////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+///
+/// Receive one packet from QEMU and act on it. Only called once poll()
+/// says the V4V socket is readable, so the receive does not block.
+///
+/// @return negative error code on failure
+///         the packet's opcode on success
+///
+static int openxt_process_packet(void)
+{
+    int ret;
+    int32_t opcode;
+
+    // Get the packet from V4V
+    ret = openxt_v4v_recv(conn, &rcv_packet);
+    openxt_assert_ret(ret >= 0, ret, ret);
+
+    // Process the packet
+    switch(opcode = openxt_v4v_get_opcode(&rcv_packet)) {
+
+        case OPENXT_FINI:
+            break;
+
+        case OPENXT_PLAYBACK:
+            ret = openxt_process_playback();
+            openxt_assert_ret(ret == 0, ret, ret);
+            break;
+
+        case OPENXT_PLAYBACK_STREAM:
+            ret = openxt_process_playback_stream();
+            openxt_assert_ret(ret == 0, ret, ret);
+            break;
+
+        case OPENXT_PLAYBACK_DOORBELL:
+            ret = openxt_process_playback_doorbell();
+            openxt_assert_ret(ret == 0, ret, ret);
+            break;
+
+        case OPENXT_PLAYBACK_INIT:
+            ret = openxt_process_playback_init();
+            openxt_assert_ret(ret == 0, ret, ret);
+            break;
+
+        case OPENXT_PLAYBACK_FINI:
+            ret = openxt_process_playback_fini();
+            openxt_assert_ret(ret == 0, ret, ret);
+            break;
+
+        case OPENXT_PLAYBACK_SET_VOLUME:
+            ret = openxt_process_playback_set_volume();
+            openxt_assert_ret(ret == 0, ret, ret);
+            break;
+
+        case OPENXT_PLAYBACK_ENABLE_VOICE:
+            ret = openxt_process_playback_enable_voice();
+            openxt_assert_ret(ret == 0, ret, ret);
+            break;
+
+        case OPENXT_PLAYBACK_DISABLE_VOICE:
+            ret = openxt_process_playback_disable_voice();
+            openxt_assert_ret(ret == 0, ret, ret);
+            break;
+
+        case OPENXT_PLAYBACK_GET_AVAILABLE:
+            ret = openxt_process_playback_get_available();
+            openxt_assert_ret(ret == 0, ret, ret);
+            break;
+
+        case OPENXT_CAPTURE:
+            ret = openxt_process_capture();
+            openxt_assert_ret(ret == 0, ret, ret);
+            break;
+
+        case OPENXT_CAPTURE_INIT:
+            ret = openxt_process_capture_init();
+            openxt_assert_ret(ret == 0, ret, ret);
+            break;
+
+        case OPENXT_CAPTURE_FINI:
+            ret = openxt_process_capture_fini();
+            openxt_assert_ret(ret == 0, ret, ret);
+            break;
+
+        case OPENXT_CAPTURE_ENABLE_VOICE:
+            ret = openxt_process_capture_enable_voice();
+            openxt_assert_ret(ret == 0, ret, ret);
+            break;
+
+        case OPENXT_CAPTURE_DISABLE_VOICE:
+            ret = openxt_process_capture_disable_voice();
+            openxt_assert_ret(ret == 0, ret, ret);
+            break;
+
+        default:
+            openxt_warn("unknown packet opcode: %d\n", opcode);
+            exit(-EINVAL);
+    }
+
+    return opcode;
+}
+
+///
+/// Add a PCM's descriptors to the poll set.
+///
+/// @param settings the PCM
+/// @param pfds the poll set
+/// @param nfds the number of descriptors already in the set, updated
+/// @return negative error code on failure
+///         the number of descriptors added on success
+///
+static int openxt_poll_add(Settings *settings, struct pollfd *pfds, int *nfds)
+{
+    int ret;
+
+    ret = openxt_alsa_poll_descriptors(settings, pfds + *nfds, OPENXT_MAX_POLLFDS - *nfds);
+    openxt_assert_ret(ret >= 0, ret, ret);
+
+    *nfds += ret;
+    return ret;
+}
+
 /////////////////////////////////////////////////////////////////////////////////////////////////////////
 // Main                                                                                                //
 /////////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -294,8 +775,12 @@ int openxt_vmaudio(int argc, char *argv[])
 {
     // Local variables
     int ret;
+    int nfds;
+    int revents;
     int32_t opcode = 0;
-    int32_t stubdomid = 0;
+    int playback_pfds, playback_nfds;
+    int capture_pfds, capture_nfds;
+    struct pollfd pfds[OPENXT_MAX_POLLFDS];
 
     // Make sure that we have the right number of arguments.
     if (argc != 2) {
@@ -314,10 +799,11 @@ int openxt_vmaudio(int argc, char *argv[])
 
     // Setup the playback ALSA settings. Note that because the format is
     // 16 bit signed little endian with 2 channels, the total sample size per
-    // channel is 32 bits.
+    // channel is 32 bits. Playback is non-blocking, as the event loop only
+    // writes what the device has room for.
     playback_settings->fmt = SND_PCM_FORMAT_S16_LE;
     playback_settings->freq = 44100;
-    playback_settings->mode = 0;
+    playback_settings->mode = SND_PCM_NONBLOCK;
     playback_settings->stream = SND_PCM_STREAM_PLAYBACK;
     playback_settings->nchannels = 2;
     playback_settings->sample_size = sizeof(uint32_t);
@@ -341,31 +827,49 @@ int openxt_vmaudio(int argc, char *argv[])
     snprintf(playback_settings->pcm_name, MAX_NAME_LENGTH, "plug:vm-%d", stubdomid - 1);
     snprintf(playback_settings->selement_name, MAX_NAME_LENGTH, "vm-%d", stubdomid - 1);
 
+    // Create the playback jitter buffer and the capture FIFO.
+    ret = openxt_fifo_create(&playback_fifo,
+                             OPENXT_PLAYBACK_FIFO_PACKETS * OPENXT_PACKET_FRAMES,
+                             playback_settings->sample_size);
+    openxt_assert_ret(ret == 0, ret, ret);
+    ret = openxt_fifo_create(&capture_fifo,
+                             OPENXT_CAPTURE_FIFO_PACKETS * OPENXT_PACKET_FRAMES,
+                             capture_settings->sample_size);
+    openxt_assert_ret(ret == 0, ret, ret);
+
     // Cleanup memory (safety)
     memset(&snd_packet, 0, sizeof(V4VPacket));
     memset(&rcv_packet, 0, sizeof(V4VPacket));
 
     // Pointer checks
     openxt_checkp(playback_packet = openxt_v4v_get_body(&rcv_packet), -EINVAL);
+    openxt_checkp(playback_init_packet = openxt_v4v_get_body(&rcv_packet), -EINVAL);
     openxt_checkp(playback_init_ack_packet = openxt_v4v_get_body(&snd_packet), -EINVAL);
+    openxt_checkp(playback_stream_packet = openxt_v4v_get_body(&rcv_packet), -EINVAL);
+    openxt_checkp(playback_credit_packet = openxt_v4v_get_body(&snd_packet), -EINVAL);
     openxt_checkp(playback_set_volume_packet = openxt_v4v_get_body(&rcv_packet), -EINVAL);
     openxt_checkp(playback_get_available_ack_packet = openxt_v4v_get_body(&snd_packet), -EINVAL);
 
     // Pointer checks
     openxt_checkp(capture_packet = openxt_v4v_get_body(&rcv_packet), -EINVAL);
     openxt_checkp(capture_ack_packet = openxt_v4v_get_body(&snd_packet), -EINVAL);
+    openxt_checkp(capture_init_packet = openxt_v4v_get_body(&rcv_packet), -EINVAL);
     openxt_checkp(capture_init_ack_packet = openxt_v4v_get_body(&snd_packet), -EINVAL);
     openxt_checkp(capture_get_available_ack_packet = openxt_v4v_get_body(&snd_packet), -EINVAL);
 
     // Size checks
     openxt_assert(openxt_v4v_validate(sizeof(OpenXTPlaybackPacket)) == true, -EINVAL);
+    openxt_assert(openxt_v4v_validate(sizeof(OpenXTPlaybackInitPacket)) == true, -EINVAL);
     openxt_assert(openxt_v4v_validate(sizeof(OpenXTPlaybackInitAckPacket)) == true, -EINVAL);
+    openxt_assert(openxt_v4v_validate(sizeof(OpenXTPlaybackStreamPacket)) == true, -EINVAL);
+    openxt_assert(openxt_v4v_validate(sizeof(OpenXTPlaybackCreditPacket)) == true, -EINVAL);
     openxt_assert(openxt_v4v_validate(sizeof(OpenXTPlaybackSetVolumePacket)) == true, -EINVAL);
     openxt_assert(openxt_v4v_validate(sizeof(OpenXTPlaybackGetAvailableAckPacket)) == true, -EINVAL);
 
     // Size checks
     openxt_assert(openxt_v4v_validate(sizeof(OpenXTCapturePacket)) == true, -EINVAL);
     openxt_assert(openxt_v4v_validate(sizeof(OpenXTCaptureAckPacket)) == true, -EINVAL);
+    openxt_assert(openxt_v4v_validate(sizeof(OpenXTCaptureInitPacket)) == true, -EINVAL);
     openxt_assert(openxt_v4v_validate(sizeof(OpenXTCaptureInitAckPacket)) == true, -EINVAL);
     openxt_assert(openxt_v4v_validate(sizeof(OpenXTCaptureGetAvailableAckPacket)) == true, -EINVAL);
 
@@ -373,83 +877,68 @@ int openxt_vmaudio(int argc, char *argv[])
     conn = openxt_v4v_open(OPENXT_AUDIO_PORT, V4V_DOMID_ANY, V4V_PORT_NONE, stubdomid);
     openxt_assert_ret(conn != NULL, conn, -EINVAL);
 
-    // Process incoming commands from QEMU in the stubdomain. Once we get a
-    // "fini" command from QEMU, we know that we can stop executing.
+    // Process incoming commands from QEMU in the stubdomain, and feed both
+    // PCMs as they become ready. Nothing here blocks but poll(), so a slow
+    // playback device no longer holds up capture or GET_AVAILABLE. Once we
+    // get a "fini" command from QEMU, we know that we can stop executing.
     while (opcode != OPENXT_FINI) {
 
-        // Wait for a packet to come in from V4V
-        ret = openxt_v4v_recv(conn, &rcv_packet);
-        openxt_assert_ret(ret >= 0, ret, ret);
-
-        // Process the packet
-        switch(opcode = openxt_v4v_get_opcode(&rcv_packet)) {
-
-            case OPENXT_FINI:
-                break;
-
-            case OPENXT_PLAYBACK:
-                ret = openxt_process_playback();
-                openxt_assert_ret(ret == 0, ret, ret);
-                break;
-
-            case OPENXT_PLAYBACK_INIT:
-                ret = openxt_process_playback_init();
-                openxt_assert_ret(ret == 0, ret, ret);
-                break;
-
-            case OPENXT_PLAYBACK_FINI:
-                ret = openxt_process_playback_fini();
-                openxt_assert_ret(ret == 0, ret, ret);
-                break;
-
-            case OPENXT_PLAYBACK_SET_VOLUME:
-                ret = openxt_process_playback_set_volume();
-                openxt_assert_ret(ret == 0, ret, ret);
-                break;
-
-            case OPENXT_PLAYBACK_ENABLE_VOICE:
-                ret = openxt_process_playback_enable_voice();
-                openxt_assert_ret(ret == 0, ret, ret);
-                break;
-
-            case OPENXT_PLAYBACK_DISABLE_VOICE:
-                ret = openxt_process_playback_disable_voice();
-                openxt_assert_ret(ret == 0, ret, ret);
-                break;
+        nfds = 0;
+
+        // V4V first, so it is always pfds[0]
+        pfds[nfds].fd = conn->fd;
+        pfds[nfds].events = POLLIN;
+        pfds[nfds].revents = 0;
+        nfds++;
+
+        // Only wait on playback while there is something to write to it,
+        // otherwise a PCM with room would wake us up in a loop.
+        playback_pfds = nfds;
+        playback_nfds = 0;
+        if (openxt_playback_pending() > 0) {
+            playback_nfds = openxt_poll_add(playback_settings, pfds, &nfds);
+            openxt_assert_ret(playback_nfds >= 0, playback_nfds, playback_nfds);
+        }
 
-            case OPENXT_PLAYBACK_GET_AVAILABLE:
-                ret = openxt_process_playback_get_available();
-                openxt_assert_ret(ret == 0, ret, ret);
-                break;
+        capture_pfds = nfds;
+        capture_nfds = 0;
+        if (openxt_capture_pollable() == true) {
+            capture_nfds = openxt_poll_add(capture_settings, pfds, &nfds);
+            openxt_assert_ret(capture_nfds >= 0, capture_nfds, capture_nfds);
+        }
 
-            case OPENXT_CAPTURE:
-                ret = openxt_process_capture();
-                openxt_assert_ret(ret == 0, ret, ret);
-                break;
+        // Wait for something to do
+        ret = poll(pfds, nfds, -1);
+        if (ret < 0 && errno == EINTR)
+            continue;
+        openxt_assert_ret(ret > 0, errno, -errno);
 
-            case OPENXT_CAPTURE_INIT:
-                ret = openxt_process_capture_init();
-                openxt_assert_ret(ret == 0, ret, ret);
-                break;
+        // Playback has room (or has xrun'd, which the write recovers)
+        if (playback_nfds > 0) {
+            revents = openxt_alsa_poll_revents(playback_settings, pfds + playback_pfds, playback_nfds);
+            openxt_assert_ret(revents >= 0, revents, revents);
 
-            case OPENXT_CAPTURE_FINI:
-                ret = openxt_process_capture_fini();
+            if ((revents & (POLLOUT | POLLERR)) != 0) {
+                ret = openxt_playback_drain();
                 openxt_assert_ret(ret == 0, ret, ret);
-                break;
+            }
+        }
 
-            case OPENXT_CAPTURE_ENABLE_VOICE:
-                ret = openxt_process_capture_enable_voice();
-                openxt_assert_ret(ret == 0, ret, ret);
-                break;
+        // Capture has data (or has xrun'd, which the read recovers)
+        if (capture_nfds > 0) {
+            revents = openxt_alsa_poll_revents(capture_settings, pfds + capture_pfds, capture_nfds);
+            openxt_assert_ret(revents >= 0, revents, revents);
 
-            case OPENXT_CAPTURE_DISABLE_VOICE:
-                ret = openxt_process_capture_disable_voice();
+            if ((revents & (POLLIN | POLLERR)) != 0) {
+                ret = openxt_capture_fill();
                 openxt_assert_ret(ret == 0, ret, ret);
-                break;
+            }
+        }
 
-            default:
-                openxt_warn("unknown packet opcode: %d\n", opcode);
-                exit(-EINVAL);
+        // A packet from QEMU
+        if ((pfds[0].revents & (POLLIN | POLLERR | POLLHUP)) != 0) {
+            opcode = openxt_process_packet();
+            openxt_assert_ret(opcode >= 0, opcode, opcode);
         }
     }
 
@@ -463,9 +952,19 @@ int openxt_vmaudio(int argc, char *argv[])
     openxt_alsa_fini(playback_settings);
     openxt_alsa_fini(capture_settings);
 
+    // Report what had to be thrown away
+    if (playback_fifo->dropped > 0 || capture_fifo->dropped > 0)
+        openxt_info("dropped %lld playback and %lld capture frames\n",
+                    (long long)playback_fifo->dropped,
+                    (long long)capture_fifo->dropped);
+
     // Cleanup
     openxt_alsa_destroy(playback_settings);
     openxt_alsa_destroy(capture_settings);
+    openxt_fifo_destroy(playback_fifo);
+    openxt_fifo_destroy(capture_fifo);
+    openxt_shm_unmap(playback_shm);
+    openxt_shm_unmap(capture_shm);
 
     // Done
     return 0;
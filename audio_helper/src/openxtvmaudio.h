@@ -23,6 +23,42 @@
 #ifndef OPENXT_VMAUDIO_H
 #define OPENXT_VMAUDIO_H
 
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "openxtv4v.h"
+#include "openxtalsa.h"
+#include "openxtfifo.h"
+#include "openxtshm.h"
+#include "openxtpackets.h"
+
 int openxt_vmaudio(int argc, char *argv[]);
 
+///
+/// The playback path and its credit accounting, reached by the unit tests
+/// without going through the V4V event loop.
+///
+extern Settings *playback_settings;
+extern OpenXTFifo *playback_fifo;
+extern bool playback_credit;
+extern int32_t playback_window;
+extern uint32_t playback_position;
+extern uint32_t playback_granted;
+extern V4VPacket snd_packet;
+extern V4VConnection *conn;
+extern OpenXTPlaybackCreditPacket *playback_credit_packet;
+
+int openxt_playback_queue(void *samples, int32_t num);
+int openxt_playback_drain(void);
+
+///
+/// The same for capture, and when the main loop waits on the PCM.
+///
+extern Settings *capture_settings;
+extern OpenXTShm *capture_shm;
+extern bool capture_enabled;
+
+int openxt_capture_fill(void);
+bool openxt_capture_pollable(void);
+
 #endif // OPENXT_VMAUDIO_H
@@ -20,11 +20,20 @@
 // Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
 //
 
+#define _GNU_SOURCE
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+
 #include "unittest.h"
 
 #include "openxtv4v.h"
 #include "openxtalsa.h"
+#include "openxtfifo.h"
+#include "openxtshm.h"
 #include "openxtdebug.h"
+#include "openxtvmaudio.h"
 
 ////////////////////////////////////////////////////////////////////////////////
 // Global Variables                                                           //
@@ -642,6 +651,350 @@ void test_playback(void)
     }
 }
 
+void test_credit(void)
+{
+    int32_t i;
+    int32_t frames[16];
+    V4VConnection *qemu = NULL;
+    V4VPacket packet;
+    OpenXTPlaybackCreditPacket *credit = NULL;
+
+    for (i = 0; i < 16; i++)
+        frames[i] = i;
+
+    memset(&snd_packet, 0, sizeof(snd_packet));
+    memset(&packet, 0, sizeof(packet));
+
+    // ALSA's null PCM stands in for the device. It takes every frame it
+    // is given, so only the jitter buffer can drop.
+    UT_CHECK(openxt_alsa_create(&playback_settings) == 0);
+    openxt_checkp(playback_settings);
+
+    playback_settings->fmt = SND_PCM_FORMAT_S16_LE;
+    playback_settings->freq = 44100;
+    playback_settings->mode = 0;
+    playback_settings->stream = SND_PCM_STREAM_PLAYBACK;
+    playback_settings->nchannels = 2;
+    playback_settings->sample_size = sizeof(uint32_t);
+    snprintf(playback_settings->pcm_name, sizeof(playback_settings->pcm_name), "null");
+
+    UT_CHECK(openxt_alsa_init(playback_settings) == 0);
+    UT_CHECK(openxt_alsa_prepare(playback_settings) == 0);
+
+    // A jitter buffer of 8 frames, and a window of 8 frames, so a credit
+    // is due every 4 frames the device takes.
+    UT_CHECK(openxt_fifo_create(&playback_fifo, 8, sizeof(int32_t)) == 0);
+
+    // QEMU's end of the connection, where the credits arrive.
+    UT_CHECK((conn = openxt_v4v_open(V4V_PORT_NONE, V4V_DOMID_ANY, 5001, 0)) != NULL);
+    UT_CHECK((qemu = openxt_v4v_open(5001, V4V_DOMID_ANY, V4V_PORT_NONE, 0)) != NULL);
+    UT_CHECK((playback_credit_packet = openxt_v4v_get_body(&snd_packet)) != NULL);
+    UT_CHECK((credit = openxt_v4v_get_body(&packet)) != NULL);
+    UT_CHECK(openxt_v4v_set_length(&packet, sizeof(OpenXTPlaybackCreditPacket)) == 0);
+
+    playback_credit = true;
+    playback_window = 8;
+    playback_position = 0;
+    playback_granted = 0;
+
+    // Less than half the window taken: no credit yet
+    UT_CHECK(openxt_playback_queue(frames, 3) == 0);
+    UT_CHECK(playback_position == 3);
+    UT_CHECK(playback_granted == 0);
+    UT_CHECK(openxt_fifo_fill(playback_fifo) == 0);
+
+    // Half the window: QEMU is told where the device is
+    UT_CHECK(openxt_playback_queue(frames, 1) == 0);
+    UT_CHECK(playback_position == 4);
+    UT_CHECK(playback_granted == 4);
+    UT_CHECK(openxt_v4v_recv(qemu, &packet) == sizeof(OpenXTPlaybackCreditPacket));
+    UT_CHECK(openxt_v4v_get_opcode(&packet) == OPENXT_PLAYBACK_CREDIT);
+    UT_CHECK(credit->position == 4);
+    UT_CHECK(credit->window == 8);
+
+    // Nothing new for the device: nothing moves
+    UT_CHECK(openxt_playback_drain() == 0);
+    UT_CHECK(playback_position == 4);
+    UT_CHECK(playback_granted == 4);
+
+    // More than the jitter buffer holds: the 4 frames dropped still count
+    // as taken, so QEMU's credits stay in step.
+    UT_CHECK(openxt_playback_queue(frames, 12) == 0);
+    UT_CHECK(playback_position == 16);
+    UT_CHECK(playback_granted == 16);
+    UT_CHECK(openxt_v4v_recv(qemu, &packet) == sizeof(OpenXTPlaybackCreditPacket));
+    UT_CHECK(credit->position == 16);
+    UT_CHECK(credit->window == 8);
+
+    // Without credits, the position still moves but nothing is sent
+    playback_credit = false;
+    UT_CHECK(openxt_playback_queue(frames, 8) == 0);
+    UT_CHECK(playback_position == 24);
+    UT_CHECK(playback_granted == 16);
+
+    // Cleanup
+    UT_CHECK(openxt_v4v_close(conn) == 0);
+    UT_CHECK(openxt_v4v_close(qemu) == 0);
+    UT_CHECK(openxt_fifo_destroy(playback_fifo) == 0);
+    UT_CHECK(openxt_alsa_fini(playback_settings) == 0);
+    UT_CHECK(openxt_alsa_destroy(playback_settings) == 0);
+    conn = NULL;
+    playback_fifo = NULL;
+    playback_settings = NULL;
+    playback_credit_packet = NULL;
+}
+
+void test_capture_ring(void)
+{
+    int fd;
+    OpenXTShmDesc desc;
+
+    memset(&desc, 0, sizeof(desc));
+    desc.type = OPENXT_SHM_MEMFD;
+    desc.owner = getpid();
+    desc.npages = 3;
+
+    UT_CHECK((fd = memfd_create("openxt_unittest", MFD_ALLOW_SEALING)) >= 0);
+    UT_CHECK(ftruncate(fd, desc.npages * OPENXT_SHM_PAGE_SIZE) == 0);
+    UT_CHECK(fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK) == 0);
+    desc.fd = fd;
+
+    UT_CHECK(openxt_shm_map(&capture_shm, &desc, sizeof(int32_t), 0) == 0);
+    openxt_checkp(capture_shm);
+
+    // ALSA's null PCM stands in for the device, and always has frames
+    // ready, as a device would once QEMU stops reading.
+    UT_CHECK(openxt_alsa_create(&capture_settings) == 0);
+    openxt_checkp(capture_settings);
+
+    capture_settings->fmt = SND_PCM_FORMAT_S16_LE;
+    capture_settings->freq = 44100;
+    capture_settings->mode = SND_PCM_NONBLOCK;
+    capture_settings->stream = SND_PCM_STREAM_CAPTURE;
+    capture_settings->nchannels = 2;
+    capture_settings->sample_size = sizeof(uint32_t);
+    snprintf(capture_settings->pcm_name, sizeof(capture_settings->pcm_name), "null");
+
+    UT_CHECK(openxt_alsa_init(capture_settings) == 0);
+    UT_CHECK(openxt_alsa_prepare(capture_settings) == 0);
+    UT_CHECK(openxt_alsa_start(capture_settings) == 0);
+
+    // Disabled capture is never waited on
+    capture_enabled = false;
+    UT_CHECK(openxt_capture_pollable() == false);
+
+    // Room in the ring: the PCM is waited on, and fills it
+    capture_enabled = true;
+    UT_CHECK(openxt_capture_pollable() == true);
+    UT_CHECK(openxt_capture_fill() == 0);
+    UT_CHECK(openxt_shm_fill(capture_shm) == 2048);
+
+    // Full ring, PCM still ready: it must leave the poll set, or poll()
+    // returns straight away until QEMU reads. Filling does nothing.
+    UT_CHECK(openxt_capture_pollable() == false);
+    UT_CHECK(openxt_capture_fill() == 0);
+    UT_CHECK(openxt_shm_fill(capture_shm) == 2048);
+
+    // Once QEMU has read some, the PCM is waited on again
+    UT_CHECK(openxt_shm_consume(capture_shm, 16) == 0);
+    UT_CHECK(openxt_capture_pollable() == true);
+    UT_CHECK(openxt_capture_fill() == 0);
+    UT_CHECK(openxt_capture_pollable() == false);
+
+    // Cleanup
+    capture_enabled = false;
+    UT_CHECK(openxt_shm_unmap(capture_shm) == 0);
+    UT_CHECK(openxt_alsa_fini(capture_settings) == 0);
+    UT_CHECK(openxt_alsa_destroy(capture_settings) == 0);
+    capture_shm = NULL;
+    capture_settings = NULL;
+    close(fd);
+}
+
+void test_fifo(void)
+{
+    int ret;
+    int32_t i;
+    void *frames;
+    int32_t in[16];
+    int32_t out[16];
+    OpenXTFifo *fifo = NULL;
+
+    for (i = 0; i < 16; i++)
+        in[i] = i;
+
+    // Validate improper creation of the FIFO
+    UT_CHECK(openxt_fifo_create(NULL, 8, sizeof(int32_t)) == -EINVAL);
+    UT_CHECK(openxt_fifo_create(&fifo, 0, sizeof(int32_t)) == -EINVAL);
+    UT_CHECK(openxt_fifo_create(&fifo, 8, 0) == -EINVAL);
+
+    // Make sure that we can only create the FIFO once
+    UT_CHECK(openxt_fifo_create(&fifo, 8, sizeof(int32_t)) == 0);
+    UT_CHECK(openxt_fifo_create(&fifo, 8, sizeof(int32_t)) == -EINVAL);
+
+    // Validate improper usage of the API
+    UT_CHECK(openxt_fifo_fill(NULL) == -EINVAL);
+    UT_CHECK(openxt_fifo_space(NULL) == -EINVAL);
+    UT_CHECK(openxt_fifo_push(NULL, in, 1) == -EINVAL);
+    UT_CHECK(openxt_fifo_push(fifo, NULL, 1) == -EINVAL);
+    UT_CHECK(openxt_fifo_pop(NULL, out, 1) == -EINVAL);
+    UT_CHECK(openxt_fifo_pop(fifo, NULL, 1) == -EINVAL);
+    UT_CHECK(openxt_fifo_consume(fifo, 1) == -EINVAL);
+    UT_CHECK(openxt_fifo_commit(fifo, 9) == -EINVAL);
+
+    // Empty
+    UT_CHECK(openxt_fifo_fill(fifo) == 0);
+    UT_CHECK(openxt_fifo_space(fifo) == 8);
+    UT_CHECK(openxt_fifo_pop(fifo, out, 4) == 0);
+
+    // Partial push and pop
+    UT_CHECK(openxt_fifo_push(fifo, in, 6) == 6);
+    UT_CHECK(openxt_fifo_pop(fifo, out, 4) == 4);
+    UT_CHECK(memcmp(out, in, 4 * sizeof(int32_t)) == 0);
+
+    // Overflow: only 6 of 10 fit, the rest are counted as dropped
+    UT_CHECK(openxt_fifo_push(fifo, in + 6, 10) == 6);
+    UT_CHECK(openxt_fifo_fill(fifo) == 8);
+    UT_CHECK(openxt_fifo_space(fifo) == 0);
+    UT_CHECK(fifo->dropped == 4);
+
+    // The contents wrap, so the contiguous run at the head stops at the end
+    UT_CHECK((ret = openxt_fifo_peek(fifo, &frames)) == 4);
+    UT_CHECK(ret == 4 && memcmp(frames, in + 4, 4 * sizeof(int32_t)) == 0);
+
+    // Popping across the wrap keeps the order
+    UT_CHECK(openxt_fifo_pop(fifo, out, 16) == 8);
+    UT_CHECK(memcmp(out, in + 4, 8 * sizeof(int32_t)) == 0);
+
+    // Writing in place at the tail
+    UT_CHECK((ret = openxt_fifo_reserve(fifo, &frames)) == 4);
+    if (ret == 4) memcpy(frames, in, 4 * sizeof(int32_t));
+    UT_CHECK(openxt_fifo_commit(fifo, 4) == 0);
+    UT_CHECK(openxt_fifo_pop(fifo, out, 4) == 4);
+    UT_CHECK(memcmp(out, in, 4 * sizeof(int32_t)) == 0);
+
+    // Reset throws everything away
+    UT_CHECK(openxt_fifo_push(fifo, in, 3) == 3);
+    UT_CHECK(openxt_fifo_reset(fifo) == 0);
+    UT_CHECK(openxt_fifo_fill(fifo) == 0);
+
+    // Cleanup
+    UT_CHECK(openxt_fifo_destroy(fifo) == 0);
+    UT_CHECK(openxt_fifo_destroy(NULL) == 0);
+    fifo = NULL;
+}
+
+///
+/// Uses a memfd of our own as the ring, the way a QEMU running in dom0
+/// would share one.
+///
+void test_shm(void)
+{
+    int fd;
+    int ret;
+    int32_t i;
+    void *frames;
+    int32_t in[2048];
+    int32_t out[2048];
+    OpenXTShm *shm = NULL;
+    OpenXTShmDesc desc;
+
+    for (i = 0; i < 2048; i++)
+        in[i] = i;
+
+    memset(&desc, 0, sizeof(desc));
+    desc.type = OPENXT_SHM_MEMFD;
+    desc.owner = getpid();
+    desc.npages = 3;
+
+    UT_CHECK((fd = memfd_create("openxt_unittest", MFD_ALLOW_SEALING)) >= 0);
+    UT_CHECK(ftruncate(fd, desc.npages * OPENXT_SHM_PAGE_SIZE) == 0);
+    desc.fd = fd;
+
+    // QEMU could shrink an unsealed memfd under us
+    UT_CHECK(openxt_shm_map(&shm, &desc, sizeof(int32_t), 0) == -EPERM);
+    UT_CHECK(shm == NULL);
+    UT_CHECK(fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK) == 0);
+
+    // Validate improper mapping of the ring
+    UT_CHECK(openxt_shm_map(NULL, &desc, sizeof(int32_t), 0) == -EINVAL);
+    UT_CHECK(openxt_shm_map(&shm, NULL, sizeof(int32_t), 0) == -EINVAL);
+    desc.npages = 4;
+    UT_CHECK(openxt_shm_map(&shm, &desc, sizeof(int32_t), 0) == -EINVAL);
+    desc.npages = OPENXT_SHM_MAX_PAGES + 1;
+    UT_CHECK(openxt_shm_map(&shm, &desc, sizeof(int32_t), 0) == -EINVAL);
+    desc.npages = 5;
+    UT_CHECK(openxt_shm_map(&shm, &desc, sizeof(int32_t), 0) == -EINVAL);
+    desc.npages = 3;
+    desc.type = 0;
+    UT_CHECK(openxt_shm_map(&shm, &desc, sizeof(int32_t), 0) == -EINVAL);
+    UT_CHECK(shm == NULL);
+    desc.type = OPENXT_SHM_MEMFD;
+
+    // A memfd is only taken from QEMU in dom0
+    UT_CHECK(openxt_shm_map(&shm, &desc, sizeof(int32_t), 1) == -EPERM);
+    UT_CHECK(shm == NULL);
+
+    // Map it, and make sure that the header is laid out
+    UT_CHECK(openxt_shm_map(&shm, &desc, sizeof(int32_t), 0) == 0);
+    UT_CHECK(openxt_shm_map(&shm, &desc, sizeof(int32_t), 0) == -EINVAL);
+    UT_CHECK(shm != NULL && shm->size == 2048);
+    UT_CHECK(shm != NULL && shm->header->magic == OPENXT_SHM_MAGIC);
+    UT_CHECK(openxt_shm_fill(shm) == 0);
+    UT_CHECK(openxt_shm_space(shm) == 2048);
+
+    // Produce, then consume across the end of the ring
+    UT_CHECK(openxt_shm_reserve(shm, &frames) == 2048);
+    UT_CHECK(openxt_shm_commit(shm, 1500) == 0);
+    UT_CHECK(openxt_shm_consume(shm, 1500) == 0);
+    UT_CHECK(openxt_shm_consume(shm, 1) == -EINVAL);
+    UT_CHECK((ret = openxt_shm_reserve(shm, &frames)) == 548);
+    if (ret == 548) memcpy(frames, in, 548 * sizeof(int32_t));
+    UT_CHECK(openxt_shm_commit(shm, 548) == 0);
+    UT_CHECK((ret = openxt_shm_reserve(shm, &frames)) == 1500);
+    if (ret == 1500) memcpy(frames, in + 548, 452 * sizeof(int32_t));
+    UT_CHECK(openxt_shm_commit(shm, 452) == 0);
+    UT_CHECK(openxt_shm_commit(shm, 1049) == -EINVAL);
+    UT_CHECK(openxt_shm_fill(shm) == 1000);
+    UT_CHECK((ret = openxt_shm_peek(shm, &frames)) == 548);
+    if (ret == 548) memcpy(out, frames, 548 * sizeof(int32_t));
+    UT_CHECK(openxt_shm_consume(shm, 548) == 0);
+    UT_CHECK((ret = openxt_shm_peek(shm, &frames)) == 452);
+    if (ret == 452) memcpy(out + 548, frames, 452 * sizeof(int32_t));
+    UT_CHECK(openxt_shm_consume(shm, 452) == 0);
+    UT_CHECK(memcmp(out, in, 1000 * sizeof(int32_t)) == 0);
+
+    // A write position from the other side that is out of range is
+    // clamped to the size of the ring
+    shm->header->write = shm->header->read + 100000;
+    UT_CHECK(openxt_shm_fill(shm) == 2048);
+    UT_CHECK(openxt_shm_peek(shm, &frames) <= 2048);
+    UT_CHECK(openxt_shm_reset(shm) == 0);
+    UT_CHECK(openxt_shm_fill(shm) == 0);
+
+    // Cleanup
+    UT_CHECK(openxt_shm_unmap(shm) == 0);
+    UT_CHECK(openxt_shm_unmap(NULL) == 0);
+    shm = NULL;
+    close(fd);
+
+    // A memfd shorter than the ring cannot be mapped
+    UT_CHECK((fd = memfd_create("openxt_unittest", MFD_ALLOW_SEALING)) >= 0);
+    UT_CHECK(ftruncate(fd, OPENXT_SHM_PAGE_SIZE) == 0);
+    UT_CHECK(fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK) == 0);
+    desc.fd = fd;
+    UT_CHECK(openxt_shm_map(&shm, &desc, sizeof(int32_t), 0) == -EINVAL);
+    close(fd);
+
+    // Nor can a file that is not a memfd at all
+    UT_CHECK((fd = open("/tmp", O_TMPFILE | O_RDWR, 0600)) >= 0);
+    UT_CHECK(ftruncate(fd, desc.npages * OPENXT_SHM_PAGE_SIZE) == 0);
+    desc.fd = fd;
+    UT_CHECK(openxt_shm_map(&shm, &desc, sizeof(int32_t), 0) == -EINVAL);
+    UT_CHECK(shm == NULL);
+    close(fd);
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 // Support                                                                    //
 ////////////////////////////////////////////////////////////////////////////////
@@ -656,8 +1009,12 @@ int openxt_unittest(int argc, char *argv[])
         openxt_info("available tests:\n");
         openxt_info("    - test_v4v\n");
         openxt_info("    - test_alsa\n");
+        openxt_info("    - test_fifo\n");
+        openxt_info("    - test_shm\n");
         openxt_info("    - test_capture\n");
         openxt_info("    - test_playback\n");
+        openxt_info("    - test_credit\n");
+        openxt_info("    - test_capture_ring\n");
         return -EINVAL;
     }
 
@@ -673,8 +1030,12 @@ int openxt_unittest(int argc, char *argv[])
     for (i = 2; i < argc; i++) {
         if (strcmp(argv[i], "test_v4v") == 0) test_v4v();
         if (strcmp(argv[i], "test_alsa") == 0) test_alsa();
+        if (strcmp(argv[i], "test_fifo") == 0) test_fifo();
+        if (strcmp(argv[i], "test_shm") == 0) test_shm();
         if (strcmp(argv[i], "test_capture") == 0) test_capture();
         if (strcmp(argv[i], "test_playback") == 0) test_playback();
+        if (strcmp(argv[i], "test_credit") == 0) test_credit();
+        if (strcmp(argv[i], "test_capture_ring") == 0) test_capture_ring();
     }
 
     // Footer
@@ -16,6 +16,17 @@
  * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
  */
 
+/*
+ * dmbus benchmark device model.
+ *
+ * Connects to the benchmark service over the UNIX transport and measures:
+ *   - throughput: back-to-back switcher_leds messages, sent in batches and
+ *     fenced by a final config_io_read so they are all known handled,
+ *   - latency: config_io_read round trips, reported as p50/p99/max,
+ *   - with -p, pipelined config_io_read requests instead: up to depth of
+ *     them are kept in flight using request ids, replies matched by id.
+ */
+
 #include <stdio.h>
 #include <errno.h>
 #include <stdlib.h>
@@ -24,13 +35,387 @@
 #include <unistd.h>
 #include <string.h>
 #include <sys/socket.h>
+#include <sys/un.h>
+#include <stddef.h>
+#include <time.h>
 
 #include <stdint.h>
 #include <libv4v.h>
 #include <libdmbus.h>
 
-int main(void)
+#define BATCH 256
+#define MAX_DEPTH 1024
+
+static int fd = -1;
+static uint32_t features;
+
+static union {
+    union dmbus_msg m;
+    uint8_t raw[DMBUS_MAX_MSG_LEN];
+} rx;
+static uint32_t rx_id;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int connect_service(int service_id)
+{
+    struct sockaddr_un sun;
+    socklen_t len;
+    int s;
+
+    s = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (s == -1)
+        return -1;
+
+    memset(&sun, 0, sizeof (sun));
+    sun.sun_family = AF_UNIX;
+    len = snprintf(sun.sun_path + 1, sizeof (sun.sun_path) - 1,
+                   DMBUS_UNIX_SOCKET_NAME, service_id);
+    len += offsetof(struct sockaddr_un, sun_path) + 1;
+
+    if (connect(s, (struct sockaddr *)&sun, len) == -1) {
+        close(s);
+        return -1;
+    }
+
+    return s;
+}
+
+static int send_all(const void *buf, size_t len)
+{
+    size_t b = 0;
+
+    while (b < len) {
+        ssize_t rc = send(fd, (const char *)buf + b, len - b, 0);
+
+        if (rc <= 0)
+            return -1;
+        b += rc;
+    }
+
+    return 0;
+}
+
+/*
+ * Lay a message out in wire format into buf, inserting the request id when
+ * it was negotiated. Returns the wire length.
+ */
+static size_t put_msg(void *buf, void *msg, size_t len, uint32_t id)
+{
+    struct dmbus_msg_hdr *hdr = msg;
+    uint8_t *p = buf;
+
+    if (!(features & DMBUS_FEATURE_REQUEST_ID)) {
+        hdr->msg_len = len;
+        memcpy(p, msg, len);
+        return len;
+    }
+
+    hdr->msg_len = len + sizeof (id);
+    memcpy(p, hdr, sizeof (*hdr));
+    memcpy(p + sizeof (*hdr), &id, sizeof (id));
+    memcpy(p + sizeof (*hdr) + sizeof (id), hdr + 1, len - sizeof (*hdr));
+
+    return len + sizeof (id);
+}
+
+static int send_msg(void *msg, size_t len, uint32_t id)
+{
+    uint8_t buf[DMBUS_MAX_MSG_LEN];
+
+    return send_all(buf, put_msg(buf, msg, len, id));
+}
+
+static int recv_all(void *buf, size_t len)
+{
+    size_t b = 0;
+
+    while (b < len) {
+        ssize_t rc = recv(fd, (char *)buf + b, len - b, 0);
+
+        if (rc <= 0)
+            return -1;
+        b += rc;
+    }
+
+    return 0;
+}
+
+/* Wait for a message of the given type into rx, skipping anything else. */
+static int recv_msg(uint32_t type)
+{
+    struct dmbus_msg_hdr *hdr = &rx.m.hdr;
+
+    for (;;) {
+        if (recv_all(hdr, sizeof (*hdr)))
+            return -1;
+        if (hdr->msg_len < sizeof (*hdr) || hdr->msg_len > DMBUS_MAX_MSG_LEN)
+            return -1;
+        if (features & DMBUS_FEATURE_REQUEST_ID) {
+            if (hdr->msg_len < sizeof (*hdr) + sizeof (rx_id))
+                return -1;
+            if (recv_all(&rx_id, sizeof (rx_id)))
+                return -1;
+            hdr->msg_len -= sizeof (rx_id);
+        }
+        if (recv_all(hdr + 1, hdr->msg_len - sizeof (*hdr)))
+            return -1;
+        if (hdr->msg_type == type)
+            return 0;
+    }
+}
+
+static int send_prologue(void)
+{
+    struct dmbus_conn_prologue p;
+    const char *hash_str = DMBUS_SHA1_STRING;
+    size_t i;
+
+    memset(&p, 0, sizeof (p));
+    p.domain = getpid();
+    p.type = DEVICE_TYPE_EMULATION;
+    for (i = 0; i < sizeof (p.hash); i++) {
+        unsigned int c;
+
+        sscanf(hash_str + 2 * i, "%02x", &c);
+        p.hash[i] = c;
+    }
+
+    return send_all(&p, sizeof (p));
+}
+
+/*
+ * Ask for whichever of want the service advertised in device_model_ready,
+ * which is still in rx.
+ */
+static int negotiate(uint32_t want)
+{
+    struct msg_features req;
+
+    if (rx.m.hdr.msg_len < sizeof (struct msg_device_model_ready))
+        return 0;
+    want &= rx.m.device_model_ready.features;
+    if (!want)
+        return 0;
+
+    memset(&req, 0, sizeof (req));
+    req.hdr.msg_type = DMBUS_MSG_FEATURES;
+    req.features = want;
+    if (send_msg(&req, sizeof (req), 0) || recv_msg(DMBUS_MSG_FEATURES))
+        return -1;
+    features = rx.m.features.features;
+
+    return 0;
+}
+
+static int send_config_io_read(unsigned long offset)
 {
+    struct msg_config_io_read req;
+
+    memset(&req, 0, sizeof (req));
+    req.hdr.msg_type = DMBUS_MSG_CONFIG_IO_READ;
+    req.offset = offset;
+    req.size = 4;
+
+    return send_msg(&req, sizeof (req), offset);
+}
+
+static int config_io_read(unsigned long offset)
+{
+    if (send_config_io_read(offset))
+        return -1;
+    if (recv_msg(DMBUS_MSG_CONFIG_IO_REPLY))
+        return -1;
+
+    return rx.m.config_io_reply.data == (uint32_t)offset ? 0 : -1;
+}
+
+static int bench_throughput(unsigned long count)
+{
+    static uint8_t batch[BATCH * DMBUS_MAX_MSG_LEN];
+    size_t msg_len = 0;
+    unsigned long sent = 0;
+    uint64_t t0, t1;
+    int i;
+
+    for (i = 0; i < BATCH; i++) {
+        struct msg_switcher_leds m;
+
+        memset(&m, 0, sizeof (m));
+        m.hdr.msg_type = DMBUS_MSG_SWITCHER_LEDS;
+        m.led_code = i;
+        msg_len = put_msg(batch + i * msg_len, &m, sizeof (m), i);
+    }
+
+    t0 = now_ns();
+    while (sent < count) {
+        unsigned long n = count - sent < BATCH ? count - sent : BATCH;
+
+        if (send_all(batch, n * msg_len))
+            return -1;
+        sent += n;
+    }
+    if (config_io_read(0))
+        return -1;
+    t1 = now_ns();
+
+    printf("throughput: %lu msgs in %.3f ms, %.0f msg/s\n",
+           count, (t1 - t0) / 1e6, count / ((t1 - t0) / 1e9));
+
     return 0;
 }
 
+static int cmp_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+static int bench_latency(unsigned long rounds)
+{
+    uint64_t *lat;
+    unsigned long i;
+
+    lat = calloc(rounds, sizeof (*lat));
+    if (!lat)
+        return -1;
+
+    for (i = 0; i < rounds; i++) {
+        uint64_t t0 = now_ns();
+
+        if (config_io_read(i)) {
+            free(lat);
+            return -1;
+        }
+        lat[i] = now_ns() - t0;
+    }
+
+    qsort(lat, rounds, sizeof (*lat), cmp_u64);
+    printf("latency: %lu round trips, p50 %.1f us, p99 %.1f us, max %.1f us\n",
+           rounds, lat[rounds / 2] / 1e3, lat[rounds * 99 / 100] / 1e3,
+           lat[rounds - 1] / 1e3);
+
+    free(lat);
+    return 0;
+}
+
+/*
+ * Keep depth requests in flight. The service may answer them in any order,
+ * so each reply is checked against the offset its request id stands for.
+ */
+static int bench_pipeline(unsigned long rounds, unsigned int depth)
+{
+    static uint64_t start[MAX_DEPTH];
+    uint64_t *lat;
+    unsigned long sent = 0, done = 0;
+    uint64_t t0, t1;
+
+    lat = calloc(rounds, sizeof (*lat));
+    if (!lat)
+        return -1;
+
+    t0 = now_ns();
+    while (done < rounds) {
+        while (sent < rounds && sent - done < depth) {
+            start[sent % depth] = now_ns();
+            if (send_config_io_read(sent))
+                goto fail;
+            sent++;
+        }
+
+        if (recv_msg(DMBUS_MSG_CONFIG_IO_REPLY))
+            goto fail;
+        if (rx_id >= sent || rx.m.config_io_reply.data != rx_id)
+            goto fail;
+        lat[done++] = now_ns() - start[rx_id % depth];
+    }
+    t1 = now_ns();
+
+    qsort(lat, rounds, sizeof (*lat), cmp_u64);
+    printf("pipeline: depth %u, %lu requests in %.3f ms, %.0f req/s, "
+           "p50 %.1f us, p99 %.1f us\n",
+           depth, rounds, (t1 - t0) / 1e6, rounds / ((t1 - t0) / 1e9),
+           lat[rounds / 2] / 1e3, lat[rounds * 99 / 100] / 1e3);
+
+    free(lat);
+    return 0;
+
+fail:
+    free(lat);
+    return -1;
+}
+
+int main(int argc, char **argv)
+{
+    unsigned long count = 1000000;
+    unsigned long rounds = 100000;
+    unsigned int depth = 0;
+    int service_id = DMBUS_SERVICE_DUMMY;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:l:p:s:")) != -1) {
+        switch (opt) {
+        case 'n':
+            count = strtoul(optarg, NULL, 0);
+            break;
+        case 'l':
+            rounds = strtoul(optarg, NULL, 0);
+            break;
+        case 'p':
+            depth = strtoul(optarg, NULL, 0);
+            if (depth > MAX_DEPTH)
+                depth = MAX_DEPTH;
+            break;
+        case 's':
+            service_id = atoi(optarg);
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-n messages] [-l round trips] "
+                    "[-p pipeline depth] [-s service id]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    fd = connect_service(service_id);
+    if (fd == -1) {
+        perror("connect");
+        return 1;
+    }
+
+    if (send_prologue() || recv_msg(DMBUS_MSG_DEVICE_MODEL_READY) ||
+        negotiate(depth ? DMBUS_FEATURE_REQUEST_ID : 0)) {
+        fprintf(stderr, "handshake failed\n");
+        return 1;
+    }
+
+    if (depth && !(features & DMBUS_FEATURE_REQUEST_ID)) {
+        fprintf(stderr, "service does not support request ids\n");
+        return 1;
+    }
+
+    if (count && bench_throughput(count)) {
+        fprintf(stderr, "throughput benchmark failed\n");
+        return 1;
+    }
+
+    if (rounds && !depth && bench_latency(rounds)) {
+        fprintf(stderr, "latency benchmark failed\n");
+        return 1;
+    }
+
+    if (rounds && depth && bench_pipeline(rounds, depth)) {
+        fprintf(stderr, "pipeline benchmark failed\n");
+        return 1;
+    }
+
+    close(fd);
+
+    return 0;
+}
@@ -0,0 +1,345 @@
+/*
+ * Copyright (c) 2012 Citrix Systems, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/*
+ * Input event path benchmark.
+ *
+ * The service sends dom0_input_event in bursts to a device model living in
+ * the same process, over the UNIX transport. The device model receives them
+ * either from the socket or, with DMBUS_FEATURE_INPUT_RING, from the shared
+ * ring, waking up on the doorbell. Both are timed, with the number of
+ * doorbells rung for the ring.
+ */
+
+#include <stdio.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <stddef.h>
+#include <time.h>
+
+#include <stdint.h>
+#include <libv4v.h>
+#include <libdmbus.h>
+
+static dmbus_client_t client;
+
+/*
+ * Service side.
+ */
+static int bench_connect(dmbus_client_t c, int domain, DeviceType type,
+                         int dm_domain, int fd, struct dmbus_rpc_ops **ops,
+                         void **priv)
+{
+    (void) domain;
+    (void) type;
+    (void) dm_domain;
+    (void) fd;
+
+    client = c;
+    *ops = NULL;
+    *priv = NULL;
+    return 0;
+}
+
+static struct dmbus_service_ops service_ops = {
+    .connect = bench_connect,
+};
+
+/*
+ * Device model side.
+ */
+struct dm
+{
+    int fd;
+    uint32_t features;
+    struct dmbus_input_ring *ring;
+    int doorbell;
+    unsigned long doorbells;
+};
+
+static int connect_service(int service_id)
+{
+    struct sockaddr_un sun;
+    socklen_t len;
+    int s;
+
+    s = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (s == -1)
+        return -1;
+
+    memset(&sun, 0, sizeof (sun));
+    sun.sun_family = AF_UNIX;
+    len = snprintf(sun.sun_path + 1, sizeof (sun.sun_path) - 1,
+                   DMBUS_UNIX_SOCKET_NAME, service_id);
+    len += offsetof(struct sockaddr_un, sun_path) + 1;
+
+    if (connect(s, (struct sockaddr *)&sun, len) == -1) {
+        close(s);
+        return -1;
+    }
+
+    return s;
+}
+
+static void send_prologue(struct dm *dm)
+{
+    struct dmbus_conn_prologue p;
+    const char *hash_str = DMBUS_SHA1_STRING;
+    size_t i;
+
+    memset(&p, 0, sizeof (p));
+    p.domain = 1;
+    p.type = DEVICE_TYPE_INPUT;
+    for (i = 0; i < sizeof (p.hash); i++) {
+        unsigned int c;
+
+        sscanf(hash_str + 2 * i, "%02x", &c);
+        p.hash[i] = c;
+    }
+    send(dm->fd, &p, sizeof (p), 0);
+}
+
+/* Returns the features the service advertised, -1 on failure. */
+static int64_t recv_ready(struct dm *dm)
+{
+    struct msg_device_model_ready ready;
+
+    memset(&ready, 0, sizeof (ready));
+    if (recv(dm->fd, &ready.hdr, sizeof (ready.hdr), MSG_WAITALL) !=
+        sizeof (ready.hdr) ||
+        ready.hdr.msg_len < sizeof (ready.hdr) ||
+        ready.hdr.msg_len > sizeof (ready))
+        return -1;
+    if (ready.hdr.msg_len > sizeof (ready.hdr) &&
+        recv(dm->fd, &ready.hdr + 1, ready.hdr.msg_len - sizeof (ready.hdr),
+             MSG_WAITALL) != (ssize_t)(ready.hdr.msg_len - sizeof (ready.hdr)))
+        return -1;
+
+    return ready.hdr.msg_len == sizeof (ready) ? ready.features : 0;
+}
+
+/*
+ * Ask for want. The service runs in this thread, so it is handed the
+ * request before waiting for the answer, which brings the ring and the
+ * doorbell if the ring is granted.
+ */
+static int negotiate(struct dm *dm, uint32_t want)
+{
+    struct msg_features req, ack;
+    union {
+        struct cmsghdr hdr;
+        char buf[CMSG_SPACE(sizeof (int) * 2)];
+    } ctl;
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+    struct iovec iov;
+    int fds[2];
+
+    if (!want)
+        return 0;
+
+    memset(&req, 0, sizeof (req));
+    req.hdr.msg_type = DMBUS_MSG_FEATURES;
+    req.hdr.msg_len = sizeof (req);
+    req.features = want;
+    if (send(dm->fd, &req, sizeof (req), 0) != sizeof (req))
+        return -1;
+    dmbus_handle_events(client);
+
+    iov.iov_base = &ack;
+    iov.iov_len = sizeof (ack);
+
+    memset(&msg, 0, sizeof (msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = ctl.buf;
+    msg.msg_controllen = sizeof (ctl.buf);
+
+    if (recvmsg(dm->fd, &msg, MSG_WAITALL) != sizeof (ack) ||
+        ack.hdr.msg_type != DMBUS_MSG_FEATURES)
+        return -1;
+
+    dm->features = ack.features;
+    if (!(dm->features & DMBUS_FEATURE_INPUT_RING))
+        return 0;
+
+    cmsg = CMSG_FIRSTHDR(&msg);
+    if (!cmsg || cmsg->cmsg_type != SCM_RIGHTS ||
+        cmsg->cmsg_len != CMSG_LEN(sizeof (fds)))
+        return -1;
+    memcpy(fds, CMSG_DATA(cmsg), sizeof (fds));
+
+    dm->ring = mmap(NULL, sizeof (*dm->ring), PROT_READ | PROT_WRITE,
+                    MAP_SHARED, fds[0], 0);
+    close(fds[0]);
+    if (dm->ring == MAP_FAILED)
+        return -1;
+    dm->doorbell = fds[1];
+
+    return 0;
+}
+
+static unsigned long drain_socket(struct dm *dm, unsigned long want)
+{
+    static struct msg_dom0_input_event buf[256];
+    unsigned long got = 0;
+
+    /* Every message on this connection is a dom0_input_event. */
+    while (got < want) {
+        size_t n = want - got < 256 ? want - got : 256;
+        size_t b = 0;
+
+        while (b < n * sizeof (buf[0])) {
+            ssize_t rc = recv(dm->fd, (char *)buf + b,
+                              n * sizeof (buf[0]) - b, 0);
+
+            if (rc <= 0)
+                return got;
+            b += rc;
+        }
+        got += n;
+    }
+
+    return got;
+}
+
+static unsigned long drain_ring(struct dm *dm, unsigned long want)
+{
+    struct dmbus_input_event ev;
+    unsigned long got = 0;
+    uint64_t count;
+
+    while (got < want) {
+        if (read(dm->doorbell, &count, sizeof (count)) != sizeof (count))
+            return got;
+        dm->doorbells++;
+
+        while (dmbus_input_ring_pop(dm->ring, &ev))
+            got++;
+    }
+
+    return got;
+}
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int bench(uint32_t want, unsigned long total, unsigned long burst)
+{
+    dmbus_service_t service;
+    struct msg_dom0_input_event ev;
+    struct dm dm;
+    int64_t advertised;
+    unsigned long sent = 0, got = 0;
+    double t0, t1;
+
+    memset(&dm, 0, sizeof (dm));
+    dm.doorbell = -1;
+
+    service = dmbus_init_transport(DMBUS_SERVICE_DUMMY, &service_ops,
+                                   &dmbus_transport_unix);
+    if (!service) {
+        perror("dmbus_init_transport");
+        return -1;
+    }
+
+    dm.fd = connect_service(DMBUS_SERVICE_DUMMY);
+    if (dm.fd == -1) {
+        perror("connect");
+        return -1;
+    }
+    send_prologue(&dm);
+    dmbus_handle_connect(service);
+    advertised = recv_ready(&dm);
+    if (advertised == -1 || negotiate(&dm, want & advertised)) {
+        fprintf(stderr, "handshake failed\n");
+        return -1;
+    }
+    if ((want & DMBUS_FEATURE_INPUT_RING) && !dm.ring) {
+        fprintf(stderr, "input ring not granted\n");
+        return -1;
+    }
+
+    memset(&ev, 0, sizeof (ev));
+    ev.type = 2; /* EV_REL */
+
+    t0 = now();
+    while (sent < total) {
+        unsigned long i, n = total - sent < burst ? total - sent : burst;
+
+        for (i = 0; i < n; i++) {
+            ev.value = sent + i;
+            dom0_input_event(client, &ev, sizeof (ev));
+        }
+        sent += n;
+
+        got += dm.ring ? drain_ring(&dm, sent - got) :
+                         drain_socket(&dm, sent - got);
+        if (got != sent) {
+            fprintf(stderr, "lost events: %lu sent, %lu received\n",
+                    sent, got);
+            return -1;
+        }
+    }
+    t1 = now();
+
+    printf("%-6s burst %4lu: %lu events in %.3fs, %.0f events/s",
+           dm.ring ? "ring" : "socket", burst, got, t1 - t0,
+           got / (t1 - t0));
+    if (dm.ring)
+        printf(", %lu doorbells", dm.doorbells);
+    printf("\n");
+
+    close(dm.fd);
+    if (dm.ring) {
+        munmap(dm.ring, sizeof (*dm.ring));
+        close(dm.doorbell);
+    }
+    dmbus_cleanup(service);
+
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    unsigned long total = 1000000;
+    unsigned long bursts[] = { 1, 16, 256 };
+    unsigned int i;
+
+    if (argc > 1)
+        total = strtoul(argv[1], NULL, 0);
+
+    for (i = 0; i < sizeof (bursts) / sizeof (bursts[0]); i++) {
+        if (bench(0, total, bursts[i]) ||
+            bench(DMBUS_FEATURE_INPUT_RING, total, bursts[i]))
+            return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,94 @@
+/*
+ * Copyright (c) 2012 Citrix Systems, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/*
+ * Plain driver for the fuzz entry point of the harness, no libFuzzer
+ * needed.
+ *
+ * Each file named on the command line is one input, so crashes found by
+ * harness_fuzz can be replayed under a debugger. Without arguments a fixed
+ * series of pseudo random inputs is fed instead, half of them with request
+ * ids, so that "make check" runs the entry point on every build.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#define MAX_INPUT       (64 * 1024)
+#define RANDOM_INPUTS   2000
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size);
+
+static uint8_t input[MAX_INPUT];
+
+static int replay_file(const char *path)
+{
+    FILE *f;
+    size_t len;
+
+    f = fopen(path, "rb");
+    if (!f) {
+        perror(path);
+        return -1;
+    }
+    len = fread(input, 1, sizeof (input), f);
+    fclose(f);
+
+    LLVMFuzzerTestOneInput(input, len);
+
+    return 0;
+}
+
+static void replay_random(void)
+{
+    size_t len, i;
+    int n;
+
+    srand(1);
+
+    for (n = 0; n < RANDOM_INPUTS; n++) {
+        len = 1 + rand() % 4096;
+        for (i = 0; i < len; i++)
+            input[i] = rand();
+        if (n & 1)
+            input[0] |= 0x80;
+
+        LLVMFuzzerTestOneInput(input, len);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    int i;
+
+    if (argc < 2) {
+        replay_random();
+        printf("%d random inputs\n", RANDOM_INPUTS);
+        return 0;
+    }
+
+    for (i = 1; i < argc; i++)
+        if (replay_file(argv[i]))
+            return 1;
+
+    printf("%d inputs\n", argc - 1);
+
+    return 0;
+}
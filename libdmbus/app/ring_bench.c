@@ -0,0 +1,238 @@
+/*
+ * Copyright (c) 2012 Citrix Systems, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/*
+ * Receive path benchmark.
+ *
+ * Runs over the UNIX transport so it works on any Linux box. One end of
+ * the connection plays the device model and writes bursts of back-to-back
+ * small messages, the other end is the dmbus client and is drained with
+ * dmbus_handle_events().
+ */
+
+#include <stdio.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <stddef.h>
+#include <time.h>
+
+#include <stdint.h>
+#include <libv4v.h>
+#include <libdmbus.h>
+
+#define BURST_BYTES     4000
+
+static int dm_fd = -1;
+static unsigned long handled;
+static dmbus_client_t client;
+
+/*
+ * Service side.
+ */
+static void leds(void *priv, struct msg_switcher_leds *msg, size_t msglen)
+{
+    (void) priv;
+    (void) msg;
+    (void) msglen;
+
+    handled++;
+}
+
+static void pvm_domid(void *priv, struct msg_switcher_pvm_domid *msg,
+                      size_t msglen)
+{
+    (void) priv;
+    (void) msg;
+    (void) msglen;
+
+    handled++;
+}
+
+static struct dmbus_rpc_ops rpc_ops = {
+    .switcher_leds = leds,
+    .switcher_pvm_domid = pvm_domid,
+};
+
+static int bench_connect(dmbus_client_t c, int domain, DeviceType type,
+                         int dm_domain, int fd, struct dmbus_rpc_ops **ops,
+                         void **priv)
+{
+    (void) domain;
+    (void) type;
+    (void) dm_domain;
+    (void) fd;
+
+    client = c;
+    *ops = &rpc_ops;
+    *priv = NULL;
+    return 0;
+}
+
+static struct dmbus_service_ops service_ops = {
+    .connect = bench_connect,
+};
+
+/*
+ * Device model side.
+ */
+static int connect_service(int service_id)
+{
+    struct sockaddr_un sun;
+    socklen_t len;
+    int s;
+
+    s = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (s == -1)
+        return -1;
+
+    memset(&sun, 0, sizeof (sun));
+    sun.sun_family = AF_UNIX;
+    len = snprintf(sun.sun_path + 1, sizeof (sun.sun_path) - 1,
+                   DMBUS_UNIX_SOCKET_NAME, service_id);
+    len += offsetof(struct sockaddr_un, sun_path) + 1;
+
+    if (connect(s, (struct sockaddr *)&sun, len) == -1) {
+        close(s);
+        return -1;
+    }
+
+    return s;
+}
+
+static void send_prologue(void)
+{
+    struct dmbus_conn_prologue p;
+    const char *hash_str = DMBUS_SHA1_STRING;
+    size_t i;
+
+    memset(&p, 0, sizeof (p));
+    p.domain = 1;
+    p.type = DEVICE_TYPE_INPUT;
+    for (i = 0; i < sizeof (p.hash); i++) {
+        unsigned int c;
+
+        sscanf(hash_str + 2 * i, "%02x", &c);
+        p.hash[i] = c;
+    }
+    send(dm_fd, &p, sizeof (p), 0);
+}
+
+/* Alternate 16 and 20 byte messages so that some of them straddle the end
+ * of the receive ring. */
+static size_t build_burst(uint8_t *buf, unsigned long *count)
+{
+    size_t off = 0;
+
+    *count = 0;
+    while (off + sizeof (struct msg_switcher_pvm_domid) <= BURST_BYTES) {
+        if (*count & 1) {
+            struct msg_switcher_pvm_domid *m = (void *)(buf + off);
+
+            m->hdr.msg_len = sizeof (*m);
+            m->hdr.msg_type = DMBUS_MSG_SWITCHER_PVM_DOMID;
+            m->domid = 1;
+            m->slot = 0;
+            off += sizeof (*m);
+        } else {
+            struct msg_switcher_leds *m = (void *)(buf + off);
+
+            m->hdr.msg_len = sizeof (*m);
+            m->hdr.msg_type = DMBUS_MSG_SWITCHER_LEDS;
+            m->led_code = 0;
+            off += sizeof (*m);
+        }
+        (*count)++;
+    }
+
+    return off;
+}
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char **argv)
+{
+    dmbus_service_t service;
+    uint8_t burst[BURST_BYTES];
+    uint8_t junk[DMBUS_MAX_MSG_LEN];
+    unsigned long total = 10000000;
+    unsigned long per_burst, expected = 0;
+    size_t burst_len;
+    double t0, t1;
+    struct dmbus_msg_stats st;
+
+    if (argc > 1)
+        total = strtoul(argv[1], NULL, 0);
+
+    service = dmbus_init_transport(DMBUS_SERVICE_DUMMY, &service_ops,
+                                   &dmbus_transport_unix);
+    if (!service) {
+        perror("dmbus_init_transport");
+        return 1;
+    }
+
+    dm_fd = connect_service(DMBUS_SERVICE_DUMMY);
+    if (dm_fd < 0) {
+        perror("connect");
+        return 1;
+    }
+
+    send_prologue();
+    dmbus_handle_connect(service);
+    /* Swallow device_model_ready. */
+    recv(dm_fd, junk, sizeof (junk), 0);
+
+    burst_len = build_burst(burst, &per_burst);
+
+    t0 = now();
+    while (expected < total) {
+        send(dm_fd, burst, burst_len, 0);
+        expected += per_burst;
+        while (handled < expected)
+            dmbus_handle_events(client);
+    }
+    t1 = now();
+
+    printf("%lu messages in %.3fs: %.0f msg/s, %.1f MB/s\n",
+           handled, t1 - t0, handled / (t1 - t0),
+           (double)expected / per_burst * burst_len / (t1 - t0) / 1e6);
+
+    if (!dmbus_get_stats(service, DMBUS_MSG_SWITCHER_LEDS, &st))
+        printf("%s: %llu handled, p50 %llu ns, p99 %llu ns, max %llu ns\n",
+               dmbus_msg_name(DMBUS_MSG_SWITCHER_LEDS),
+               (unsigned long long)st.rx_msgs,
+               (unsigned long long)dmbus_stats_percentile(&st, 50),
+               (unsigned long long)dmbus_stats_percentile(&st, 99),
+               (unsigned long long)st.handler_max_ns);
+
+    dmbus_cleanup(service);
+    close(dm_fd);
+
+    return 0;
+}
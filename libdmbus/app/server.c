@@ -16,6 +16,21 @@
  * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
  */
 
+/*
+ * dmbus benchmark service.
+ *
+ * Serves DMBUS_SERVICE_DUMMY, over the UNIX transport by default so it runs
+ * on any Linux box, and answers the RPCs driven by the client benchmark:
+ *   - switcher_leds is counted, it measures one-way throughput,
+ *   - config_io_read echoes the offset back, it measures round trip latency.
+ *
+ * Several services can be served at once with -s, one per service id.
+ *
+ * With -d, every other config_io_read is deferred and answered after the
+ * next one, so replies go out of order. Only pipelined clients (client -n 0
+ * -p depth) cope with that.
+ */
+
 #include <stdio.h>
 #include <errno.h>
 #include <stdlib.h>
@@ -23,12 +38,151 @@
 #include <sys/types.h>
 #include <unistd.h>
 #include <string.h>
+#include <signal.h>
 
 #include <stdint.h>
 #include <libv4v.h>
 #include <libdmbus.h>
 
-int main(void)
+static int nclients;
+static unsigned long leds_count;
+static int defer;
+
+static dmbus_request_t deferred_req;
+static struct msg_config_io_reply deferred_reply;
+static int deferred_pending;
+
+static void leds(void *priv, struct msg_switcher_leds *msg, size_t msglen)
+{
+    (void) priv;
+    (void) msg;
+    (void) msglen;
+
+    leds_count++;
+}
+
+static int config_io_read(void *priv, struct msg_config_io_read *msg,
+                          size_t msglen, struct msg_config_io_reply *out)
+{
+    dmbus_client_t client = priv;
+    dmbus_request_t req;
+
+    (void) msglen;
+
+    if (defer && !deferred_pending &&
+        !dmbus_defer_reply(client, &deferred_req)) {
+        memset(&deferred_reply, 0, sizeof (deferred_reply));
+        deferred_reply.data = (uint32_t)msg->offset;
+        deferred_pending = 1;
+        return 0;
+    }
+
+    if (deferred_pending && !dmbus_defer_reply(client, &req)) {
+        /* Answer this one first, then the older deferred request. */
+        memset(out, 0, sizeof (*out));
+        out->data = (uint32_t)msg->offset;
+        dmbus_complete_reply(client, &req, 0, out, sizeof (*out));
+        dmbus_complete_reply(client, &deferred_req, 0, &deferred_reply,
+                             sizeof (deferred_reply));
+        deferred_pending = 0;
+        return 0;
+    }
+
+    out->data = (uint32_t)msg->offset;
+    return 0;
+}
+
+static struct dmbus_rpc_ops rpc_ops = {
+    .switcher_leds = leds,
+    .config_io_read = config_io_read,
+};
+
+static int bench_connect(dmbus_client_t client, int domain, DeviceType type,
+                         int dm_domain, int fd, struct dmbus_rpc_ops **ops,
+                         void **priv)
 {
+    (void) type;
+    (void) dm_domain;
+    (void) fd;
+
+    nclients++;
+
+    *ops = &rpc_ops;
+    *priv = client;
+
+    printf("domain %d connected (%d clients)\n", domain, nclients);
+    return 0;
+}
+
+static void bench_disconnect(dmbus_client_t client, void *priv)
+{
+    (void) client;
+    (void) priv;
+
+    nclients--;
+    deferred_pending = 0;
+
+    printf("client disconnected, %lu switcher_leds received\n", leds_count);
+    leds_count = 0;
+}
+
+static struct dmbus_service_ops service_ops = {
+    .connect = bench_connect,
+    .disconnect = bench_disconnect,
+};
+
+int main(int argc, char **argv)
+{
+    const struct dmbus_transport *t = &dmbus_transport_unix;
+    dmbus_service_t services[DMBUS_SERVICE_MAX];
+    int ids[DMBUS_SERVICE_MAX];
+    int nids = 0;
+    int opt;
+    int i;
+
+    while ((opt = getopt(argc, argv, "vds:")) != -1) {
+        switch (opt) {
+        case 'v':
+            t = &dmbus_transport_v4v;
+            break;
+        case 'd':
+            defer = 1;
+            break;
+        case 's':
+            if (nids < DMBUS_SERVICE_MAX)
+                ids[nids++] = atoi(optarg);
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-v] [-d] [-s service id]...\n",
+                    argv[0]);
+            return 1;
+        }
+    }
+
+    if (!nids)
+        ids[nids++] = DMBUS_SERVICE_DUMMY;
+
+    setvbuf(stdout, NULL, _IOLBF, 0);
+
+    for (i = 0; i < nids; i++) {
+        services[i] = dmbus_init_transport(ids[i], &service_ops, t);
+        if (!services[i]) {
+            perror("dmbus_init_transport");
+            return 1;
+        }
+        printf("service %d listening on %s transport\n", ids[i], t->name);
+    }
+
+    /* kill -USR1 dumps per message type statistics to syslog. */
+    dmbus_stats_signal(SIGUSR1);
+
+    if (dmbus_run_services(services, nids)) {
+        perror("dmbus_run_services");
+        return 1;
+    }
+
+    for (i = 0; i < nids; i++)
+        dmbus_cleanup(services[i]);
+
     return 0;
 }
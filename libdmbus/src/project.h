@@ -94,10 +94,22 @@
 # endif
 
 # include <limits.h>
+# include <stddef.h>
+# include <time.h>
 # include <sys/ioctl.h>
+# include <sys/epoll.h>
+# include <sys/socket.h>
+# include <sys/uio.h>
+# include <poll.h>
+# include <signal.h>
+# include <sys/eventfd.h>
 
 # include <libv4v.h>
 
+# ifdef HAVE_LIBXENCTRL
+#  include <xenctrl.h>
+# endif
+
 # include "libdmbus.h"
 
 #endif /* __PROJECT_H__ */
@@ -13,10 +13,12 @@ divert(-1)
 #   in_message_type as a previously defined input message type.
 #   The caller does not expect a reply message.
 #
-#   DEFINE_IN_RPC_WITH_RETURN(in_message_type, out_message_type)
+#   DEFINE_IN_RPC_WITH_RETURN(in_message_type, out_message_type[, policy])
 #   Define a synchronous, inbound (dm to service) RPC using
 #   in_message_type as a previously defined input message type.
 #   The caller expects a reply of the out_message_type message type.
+#   policy, DROP_NEWEST, DROP_OLDEST or BLOCK, applies to the reply when
+#   the output queue is full. It defaults to that of out_message_type.
 #
 #   DEFINE_OUT_RPC(out_message_type)
 #   Define an asynchronous, outbound (service to dm) RPC using
@@ -72,8 +74,8 @@ DEFINE_MESSAGE(13, display_edid, uint8_t DisplayID,
 
 DEFINE_IN_RPC_WITH_RETURN(display_resize, empty_reply)
 DEFINE_IN_RPC_WITH_RETURN(display_get_info, display_info)
-DEFINE_IN_RPC_WITH_RETURN(config_io_read, config_io_reply)
-DEFINE_IN_RPC_WITH_RETURN(config_io_write, empty_reply)
+DEFINE_IN_RPC_WITH_RETURN(config_io_read, config_io_reply, BLOCK)
+DEFINE_IN_RPC_WITH_RETURN(config_io_write, empty_reply, BLOCK)
 DEFINE_IN_RPC_WITH_RETURN(attach_pci_device, empty_reply)
 DEFINE_IN_RPC_WITH_RETURN(update_pci_bar, empty_reply)
 
@@ -110,7 +112,12 @@ DEFINE_OUT_RPC(input_config_reset)
 DEFINE_OUT_RPC(input_wakeup)
 
 # Common message
-DEFINE_MESSAGE(23, device_model_ready)
+DEFINE_MESSAGE(23, device_model_ready, uint32_t features)
 DEFINE_OUT_RPC(device_model_ready) # Indicate the service is ready to emulate the new domain
 
+# Feature negotiation, handled by the library itself. The ring fields are
+# only used to share the input ring over v4v.
+DEFINE_MESSAGE(27, features, uint32_t features, uint32_t ring_port,
+               uint64_t ring_frames[DMBUS_INPUT_RING_PAGES])
+
 divert(0)dnl
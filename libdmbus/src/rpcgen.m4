@@ -12,7 +12,7 @@ foreach(`X',`    X;
 
 define(`MSG_STRUCTS',`')
 define(`SERV_MSG_OPS',`')
-define(`SERV_MSG_HANDLERS',`')
+define(`SERV_DISPATCH_TABLE',`')
 define(`DM_RPC_FUNCS',`')
 define(`DM_RPC_DEFS',`')
 
@@ -26,36 +26,16 @@ MSGSTRUCT(shift($@)))'dnl
 define(`DEFINE_IN_RPC_NO_RETURN', `define(`SERV_MSG_OPS', SERV_MSG_OPS`'dnl
 void (*$1)(``void *priv, struct msg_$1 *msg, size_t msglen'');
 )'dnl
-`define(`SERV_MSG_HANDLERS', SERV_MSG_HANDLERS`'dnl
-case MSGID_$1:
-{
-        size_t len = m->hdr.msg_len;
-
-        if (c->rpc_ops->$1) {
-            c->rpc_ops->$1(``c->priv, &m->''$1``, len'');
-        }
-        break;
-}
+`define(`SERV_DISPATCH_TABLE', SERV_DISPATCH_TABLE`'dnl
+    DISPATCH_NO_RETURN(MSGID_$1``, $1'')
 )'dnl
 )
 
 define(`DEFINE_IN_RPC_WITH_RETURN', `define(`SERV_MSG_OPS', SERV_MSG_OPS`'dnl
 int (*$1)(``void *priv, struct msg_$1 *msg, size_t msglen, struct msg_$2 *out'');
 )'dnl
-`define(`SERV_MSG_HANDLERS', SERV_MSG_HANDLERS`'dnl
-case MSGID_$1:
-{
-        struct msg_$2 out;
-        size_t len = m->hdr.msg_len;
-        int ret = -1;
-
-        if (c->rpc_ops->$1) {
-            ret = c->rpc_ops->$1(``c->priv, &m->''$1``, len, &out'');
-        }
-        out.hdr.return_value = (uint32_t) ret;
-        send_msg(``c, ''MSGID_$2``, &out, sizeof (out)'');
-        break;
-}
+`define(`SERV_DISPATCH_TABLE', SERV_DISPATCH_TABLE`'dnl
+    DISPATCH_WITH_RETURN(MSGID_$1``, $1, ''MSGID_$2``, $2, ''ifelse(`$3', `', `DISPATCH_TYPE_POLICY', `DMBUS_OVERFLOW_$3'))
 )'dnl
 )
 
@@ -72,11 +52,11 @@ define(`DEFINE_OUT_RPC', `define(`DM_RPC_DEFS', DM_RPC_DEFS
 )
 
 define(`DEFINE_BROADCAST_RPC', `define(`DM_RPC_DEFS', DM_RPC_DEFS
-`void '$1`(struct msg_'$1` *msg, size_t msglen);')'dnl
+`void '$1`(dmbus_service_t service, struct msg_'$1` *msg, size_t msglen);')'dnl
                         `define(`DM_RPC_FUNCS', DM_RPC_FUNCS
-`void '$1`(struct msg_'$1` *msg, size_t msglen)'
+`void '$1`(dmbus_service_t service, struct msg_'$1` *msg, size_t msglen)'
 {
-    broadcast_msg(MSGID_$1, msg, msglen);
+    broadcast_msg(service, MSGID_$1, msg, msglen);
 }
 )'dnl
 )
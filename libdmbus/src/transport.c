@@ -0,0 +1,233 @@
+/*
+ * Copyright (c) 2012 Citrix Systems, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include "project.h"
+
+#include <stddef.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+/*
+ * v4v transport
+ */
+static int v4v_transport_listen(int service_id)
+{
+    v4v_addr_t addr;
+    int fd;
+    int err;
+
+    fd = v4v_socket(SOCK_STREAM);
+    if (fd == -1)
+        return -1;
+
+    addr.port = DMBUS_BASE_PORT + service_id;
+    addr.domain = V4V_DOMID_ANY;
+
+    if (v4v_bind(fd, &addr, V4V_DOMID_ANY) == -1)
+        goto out_close;
+
+    if (v4v_listen(fd, 128) == -1)
+        goto out_close;
+
+    return fd;
+
+out_close:
+    err = errno;
+    v4v_close(fd);
+    errno = err;
+
+    return -1;
+}
+
+static int v4v_transport_accept(int fd, int *peer_domain)
+{
+    v4v_addr_t addr;
+    int rc;
+
+    rc = v4v_accept(fd, &addr);
+    if (rc != -1)
+        *peer_domain = addr.domain;
+
+    return rc;
+}
+
+/* libv4v has no vectored send, emulate it and stop at the first short one. */
+static ssize_t v4v_transport_sendv(int fd, const struct iovec *iov, int iovcnt,
+                                   int flags)
+{
+    ssize_t total = 0;
+    ssize_t rc;
+    int i;
+
+    for (i = 0; i < iovcnt; i++) {
+        rc = v4v_send(fd, iov[i].iov_base, iov[i].iov_len, flags);
+        if (rc == -1)
+            return total ? total : -1;
+
+        total += rc;
+        if ((size_t)rc < iov[i].iov_len)
+            break;
+    }
+
+    return total;
+}
+
+static ssize_t v4v_transport_recv(int fd, void *buf, size_t len, int flags)
+{
+    return v4v_recv(fd, buf, len, flags);
+}
+
+static void v4v_transport_close(int fd)
+{
+    v4v_close(fd);
+}
+
+const struct dmbus_transport dmbus_transport_v4v = {
+    .name = "v4v",
+    .listen = v4v_transport_listen,
+    .accept = v4v_transport_accept,
+    .sendv = v4v_transport_sendv,
+    .recv = v4v_transport_recv,
+    .close = v4v_transport_close,
+    .sendfds = NULL,
+};
+
+/*
+ * UNIX transport
+ *
+ * Sockets live in the abstract namespace so nothing has to be cleaned up
+ * on the filesystem. Peers are local, they are all reported as domain 0.
+ */
+static socklen_t unix_transport_addr(int service_id, struct sockaddr_un *sun)
+{
+    int len;
+
+    memset(sun, 0, sizeof (*sun));
+    sun->sun_family = AF_UNIX;
+    len = snprintf(sun->sun_path + 1, sizeof (sun->sun_path) - 1,
+                   DMBUS_UNIX_SOCKET_NAME, service_id);
+
+    return offsetof(struct sockaddr_un, sun_path) + 1 + len;
+}
+
+static int unix_transport_listen(int service_id)
+{
+    struct sockaddr_un sun;
+    socklen_t len;
+    int fd;
+    int err;
+
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd == -1)
+        return -1;
+
+    len = unix_transport_addr(service_id, &sun);
+    if (bind(fd, (struct sockaddr *)&sun, len) == -1)
+        goto out_close;
+
+    if (listen(fd, 128) == -1)
+        goto out_close;
+
+    return fd;
+
+out_close:
+    err = errno;
+    close(fd);
+    errno = err;
+
+    return -1;
+}
+
+static int unix_transport_accept(int fd, int *peer_domain)
+{
+    int rc;
+
+    rc = accept(fd, NULL, NULL);
+    if (rc != -1)
+        *peer_domain = 0;
+
+    return rc;
+}
+
+static ssize_t unix_transport_sendv(int fd, const struct iovec *iov,
+                                    int iovcnt, int flags)
+{
+    struct msghdr msg;
+
+    memset(&msg, 0, sizeof (msg));
+    msg.msg_iov = (struct iovec *)iov;
+    msg.msg_iovlen = iovcnt;
+
+    return sendmsg(fd, &msg, flags | MSG_NOSIGNAL);
+}
+
+#define UNIX_TRANSPORT_MAX_FDS  4
+
+static ssize_t unix_transport_sendfds(int fd, const void *buf, size_t len,
+                                      const int *fds, int nfds)
+{
+    union {
+        struct cmsghdr hdr;
+        char buf[CMSG_SPACE(sizeof (int) * UNIX_TRANSPORT_MAX_FDS)];
+    } ctl;
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+    struct iovec iov;
+
+    if (nfds <= 0 || nfds > UNIX_TRANSPORT_MAX_FDS) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    iov.iov_base = (void *)buf;
+    iov.iov_len = len;
+
+    memset(&msg, 0, sizeof (msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = ctl.buf;
+    msg.msg_controllen = CMSG_SPACE(sizeof (int) * nfds);
+
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof (int) * nfds);
+    memcpy(CMSG_DATA(cmsg), fds, sizeof (int) * nfds);
+
+    return sendmsg(fd, &msg, MSG_NOSIGNAL);
+}
+
+static ssize_t unix_transport_recv(int fd, void *buf, size_t len, int flags)
+{
+    return recv(fd, buf, len, flags);
+}
+
+static void unix_transport_close(int fd)
+{
+    close(fd);
+}
+
+const struct dmbus_transport dmbus_transport_unix = {
+    .name = "unix",
+    .listen = unix_transport_listen,
+    .accept = unix_transport_accept,
+    .sendv = unix_transport_sendv,
+    .recv = unix_transport_recv,
+    .close = unix_transport_close,
+    .sendfds = unix_transport_sendfds,
+};